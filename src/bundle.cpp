@@ -0,0 +1,248 @@
+#include "bundle.hpp"
+
+#include "exif_hash.hpp"
+#include "manifest.hpp"
+#include "protocol.hpp"
+#include "util/fd.hpp"
+#include "util/logger.hpp"
+#include "util/string_utils.hpp"
+#include "util/syscall.hpp"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+const char kMagic[4] = { 'J', 'P', 'G', 'B' };
+const unsigned char kVersion = 1;
+
+struct Header {
+  char magic[4];
+  unsigned char version;
+  unsigned char digest_id;
+  unsigned char digest_size;
+  unsigned char reserved;
+};
+
+// precedes the bytes of each image (all numbers little endian)
+struct Record {
+  unsigned char digest[sizeof(ExifHash)];
+  uint32_t name_size;
+  uint64_t size;
+} __attribute__((packed));
+
+const size_t kChunkSize = 1 << 18;
+
+// name of the file an image is written to, before it is linked in place
+const char* kTempName = ".jpgsync-apply.tmp";
+
+typedef SyncProtocol Stream; // just a reliable one
+
+void WriteExactly(int fd, const void* buf, size_t count) {
+  if (!Stream::WriteExactly(fd, buf, count))
+    throw std::runtime_error("failed to write bundle");
+}
+
+bool ReadExactly(int fd, void* buf, size_t count) {
+  size_t read_count = Stream::ReadFully(fd, buf, count);
+  if (read_count && read_count != count)
+    throw std::runtime_error("truncated bundle");
+  return read_count;
+}
+
+// Copies size bytes of the file into the bundle, without copying them
+// through user space where sendfile can write to the bundle.
+void CopyFile(int fd, int file_fd, uint64_t size) {
+  off_t offset = 0;
+  while (offset < off_t(size)) {
+    ssize_t write_count = sendfile(fd, file_fd, &offset, size - offset);
+    if (write_count == -1 && (errno == EINVAL || errno == ENOSYS))
+      break;
+    if (write_count == -1)
+      throw SysCallException(__FILE__, __LINE__, "sendfile");
+    if (!write_count)
+      throw std::runtime_error("file shrank while bundling");
+  }
+
+  std::vector<char> buf(kChunkSize);
+  while (offset < off_t(size)) {
+    ssize_t read_count;
+    sys_call_rv(read_count, pread, file_fd, buf.data(),
+                std::min<uint64_t>(buf.size(), size - offset), offset);
+    if (!read_count)
+      throw std::runtime_error("file shrank while bundling");
+    WriteExactly(fd, buf.data(), read_count);
+    offset += read_count;
+  }
+}
+
+// Returns whether the two files have the same bytes.
+bool SameContent(const std::string& path0, const std::string& path1) {
+  int fds[2];
+  sys_call_rv(fds[0], open, path0.c_str(), O_RDONLY);
+  FD fd0 = fds[0];
+  sys_call_rv(fds[1], open, path1.c_str(), O_RDONLY);
+  FD fd1 = fds[1];
+  struct stat stat_bufs[2];
+  sys_call(fstat, fd0, &stat_bufs[0]);
+  sys_call(fstat, fd1, &stat_bufs[1]);
+  if (stat_bufs[0].st_size != stat_bufs[1].st_size)
+    return false;
+
+  std::vector<char> bufs[2] = { std::vector<char>(kChunkSize),
+                                std::vector<char>(kChunkSize) };
+  while (true) {
+    size_t read_count = Stream::ReadFully(fd0, bufs[0].data(), kChunkSize);
+    if (Stream::ReadFully(fd1, bufs[1].data(), kChunkSize) != read_count ||
+        memcmp(bufs[0].data(), bufs[1].data(), read_count) != 0) {
+      return false;
+    }
+    if (read_count < kChunkSize)
+      return true;
+  }
+}
+
+} // namespace
+
+// Writes the images of the manifest at the indices (with paths relative to
+// root) to the bundle, in inode (roughly disk) order, returning their number.
+size_t WriteBundle(int fd, const std::string& root,
+                   const ManifestFile& manifest,
+                   const std::vector<size_t>& inds, Logger* logger) {
+  typedef ExifHash::DigestType Digest;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.digest_id = Digest::kId;
+  header.digest_size = Digest::kSize;
+  WriteExactly(fd, &header, sizeof(header));
+
+  std::vector<std::pair<ino_t, size_t> > files;
+  for (auto ind : inds) {
+    struct stat stat_buf;
+    auto path = root + '/' + manifest.path(ind);
+    if (stat(path.c_str(), &stat_buf) == -1)
+      logger->Warn("cannot bundle missing " + path);
+    else
+      files.push_back(std::make_pair(stat_buf.st_ino, ind));
+  }
+  std::sort(files.begin(), files.end());
+
+  size_t count = 0;
+  for (const auto& file : files) {
+    auto path = root + '/' + manifest.path(file.second);
+    int file_fd = open(path.c_str(), O_RDONLY);
+    if (file_fd == -1) {
+      logger->Warn("cannot bundle " + path + ": " + strerror(errno));
+      continue;
+    }
+    FD file_fd_closer = file_fd;
+    struct stat stat_buf;
+    sys_call(fstat, file_fd, &stat_buf);
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::string name = path.substr(path.rfind('/') + 1);
+    Record record;
+    manifest.hash(file.second).ToDigest(record.digest);
+    record.name_size = htole32(name.size());
+    record.size = htole64(stat_buf.st_size);
+    WriteExactly(fd, &record, sizeof(record));
+    WriteExactly(fd, name.data(), name.size());
+    CopyFile(fd, file_fd, stat_buf.st_size);
+    LOG_VERBOSE(logger, 2, "bundled " + path);
+    ++count;
+  }
+
+  Record end;
+  memset(&end, 0, sizeof(end));
+  WriteExactly(fd, &end, sizeof(end));
+  return count;
+}
+
+// Writes the images of the bundle to dir, under their names unless taken
+// (else suffixed with their hash), returning the number of images written.
+size_t ApplyBundle(int fd, const std::string& dir, Logger* logger) {
+  typedef ExifHash::DigestType Digest;
+  Header header;
+  if (!ReadExactly(fd, &header, sizeof(header)) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion) {
+    throw std::runtime_error("invalid bundle");
+  }
+  if (header.digest_id != Digest::kId || header.digest_size != Digest::kSize)
+    throw std::runtime_error(std::string("not a bundle of ") + Digest::name());
+
+  auto tmp_path = dir + '/' + kTempName;
+  std::vector<char> buf(kChunkSize);
+  size_t count = 0;
+  try {
+    while (true) {
+      Record record;
+      if (!ReadExactly(fd, &record, sizeof(record)))
+        throw std::runtime_error("truncated bundle");
+      std::string name(le32toh(record.name_size), '\0');
+      if (name.empty())
+        break;
+      if (name.size() > 255 || !ReadExactly(fd, &name[0], name.size()) ||
+          name.find('/') != std::string::npos || name[0] == '.') {
+        throw std::runtime_error("invalid name in bundle");
+      }
+
+      int file_fd;
+      sys_call_rv(file_fd, open, tmp_path.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      FD file_fd_closer = file_fd;
+      for (uint64_t size = le64toh(record.size); size; ) {
+        size_t chunk_size = std::min<uint64_t>(buf.size(), size);
+        if (!ReadExactly(fd, buf.data(), chunk_size))
+          throw std::runtime_error("truncated bundle");
+        ssize_t write_count;
+        for (size_t offset = 0; offset < chunk_size; offset += write_count) {
+          sys_call_rv(write_count, write, file_fd, buf.data() + offset,
+                      chunk_size - offset);
+        }
+        size -= chunk_size;
+      }
+      file_fd_closer.Close();
+
+      // link the image in place under a free name, unless it is there
+      // already (applied before): under its name if the same image has it,
+      // else under the name with its hash
+      auto path = dir + '/' + name;
+      int rv = link(tmp_path.c_str(), path.c_str());
+      if (rv == -1 && errno == EEXIST) {
+        if (SameContent(tmp_path, path)) {
+          LOG_VERBOSE(logger, 2, "already applied " + path);
+          continue;
+        }
+        path += '-' + ToString(ExifHash(record.digest));
+        if ((rv = link(tmp_path.c_str(), path.c_str())) == -1 &&
+            errno == EEXIST) {
+          LOG_VERBOSE(logger, 2, "already applied " + path);
+          continue;
+        }
+      }
+      if (rv == -1)
+        throw SysCallException(__FILE__, __LINE__, "link(" + path + ")");
+      sys_call(unlink, tmp_path.c_str());
+      LOG_VERBOSE(logger, 2, "applied " + path);
+      ++count;
+    }
+  } catch (...) {
+    unlink(tmp_path.c_str());
+    throw;
+  }
+  unlink(tmp_path.c_str());
+  return count;
+}
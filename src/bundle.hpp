@@ -0,0 +1,20 @@
+#ifndef BUNDLE_HPP_
+#define BUNDLE_HPP_
+
+#include <cstddef>
+
+#include <string>
+#include <vector>
+
+class Logger;
+class ManifestFile;
+
+// An archive of images carried from one library to another without any
+// network: a header naming the digest, then each image as its hash, name and
+// size followed by its bytes, and an image without a name at the end.
+size_t WriteBundle(int fd, const std::string& root,
+                   const ManifestFile& manifest,
+                   const std::vector<size_t>& inds, Logger* logger);
+size_t ApplyBundle(int fd, const std::string& dir, Logger* logger);
+
+#endif // BUNDLE_HPP_
@@ -0,0 +1,72 @@
+#include "digest.hpp"
+
+#include "sha1_mb.hpp"
+
+#include <openssl/evp.h>
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#include <cstring>
+
+EvpDigest::EvpDigest(const EVP_MD* md) : ctx_(EVP_MD_CTX_create()) {
+  EVP_DigestInit_ex(ctx_, md, NULL);
+}
+
+EvpDigest::~EvpDigest() { EVP_MD_CTX_destroy(ctx_); }
+
+void EvpDigest::Update(const void* data, size_t size) {
+  EVP_DigestUpdate(ctx_, data, size);
+}
+
+void EvpDigest::Final(unsigned char* digest) {
+  EVP_DigestFinal_ex(ctx_, digest, NULL);
+}
+
+Sha1::Context::Context() : EvpDigest(EVP_sha1()) {}
+
+// Hashes full groups of buffers in the AVX2 lanes, which outpaces even the
+// SHA extensions OpenSSL uses for single buffers, and the left over ones one
+// by one (a partly filled group would not).
+template<>
+void DigestMany<Sha1>(const unsigned char* const* data, const size_t* sizes,
+                      size_t count, unsigned char* const* digests) {
+  static const bool multi_buffer = HasSha1MultiBuffer();
+  size_t multi_count = 0;
+  if (multi_buffer) {
+    multi_count = count - count % kSha1Lanes;
+    Sha1MultiBuffer(data, sizes, multi_count, digests);
+  }
+  for (size_t i = multi_count; i < count; ++i) {
+    Sha1::Context ctx;
+    ctx.Update(data[i], sizes[i]);
+    ctx.Final(digests[i]);
+  }
+}
+
+Blake2s::Context::Context() : EvpDigest(EVP_blake2s256()) {}
+
+void Blake2s::Context::Final(unsigned char* digest) {
+  unsigned char full[32];
+  EvpDigest::Final(full);
+  memcpy(digest, full, kSize);
+}
+
+#ifdef HAVE_XXHASH
+Xxh3::Context::Context() : state_(XXH3_createState()) {
+  XXH3_128bits_reset(state_);
+}
+
+Xxh3::Context::~Context() { XXH3_freeState(state_); }
+
+void Xxh3::Context::Update(const void* data, size_t size) {
+  XXH3_128bits_update(state_, data, size);
+}
+
+// Writes the digest in its canonical (big endian) form.
+void Xxh3::Context::Final(unsigned char* digest) {
+  XXH128_canonical_t canonical;
+  XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state_));
+  memcpy(digest, canonical.digest, kSize);
+}
+#endif
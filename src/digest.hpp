@@ -0,0 +1,92 @@
+#ifndef DIGEST_HPP_
+#define DIGEST_HPP_
+
+#include <cstddef>
+
+struct evp_md_ctx_st;
+struct evp_md_st;
+struct XXH3_state_s;
+
+// Incremental hashing with an OpenSSL digest.
+class EvpDigest {
+ public:
+  EvpDigest(const evp_md_st* md);
+  ~EvpDigest();
+
+  void Update(const void* data, size_t size);
+  void Final(unsigned char* digest);
+
+ private:
+  EvpDigest(const EvpDigest&);
+  EvpDigest& operator=(const EvpDigest&);
+
+  evp_md_ctx_st* ctx_;
+};
+
+// Digest algorithms images can be identified by (see ExifHash), each with its
+// size (a multiple of 4 bytes), the id peers check they agree on and a
+// Context to hash incrementally with.
+
+struct Sha1 {
+  enum { kSize = 20, kId = 1 };
+  static const char* name() { return "sha1"; }
+
+  class Context : public EvpDigest {
+   public:
+    Context();
+  };
+};
+
+// BLAKE2s-256 truncated to 128 bits, so that more hashes fit in a packet than
+// with SHA-1 rather than fewer.
+struct Blake2s {
+  enum { kSize = 16, kId = 2 };
+  static const char* name() { return "blake2s"; }
+
+  class Context : public EvpDigest {
+   public:
+    Context();
+
+    void Final(unsigned char* digest);
+  };
+};
+
+#ifdef HAVE_XXHASH
+struct Xxh3 {
+  enum { kSize = 16, kId = 3 };
+  static const char* name() { return "xxh3"; }
+
+  class Context {
+   public:
+    Context();
+    ~Context();
+
+    void Update(const void* data, size_t size);
+    void Final(unsigned char* digest);
+
+   private:
+    Context(const Context&);
+    Context& operator=(const Context&);
+
+    XXH3_state_s* state_;
+  };
+};
+#endif
+
+// Hashes count buffers, several at once where the digest has a multi-buffer
+// implementation.
+template<typename Digest>
+void DigestMany(const unsigned char* const* data, const size_t* sizes,
+                size_t count, unsigned char* const* digests) {
+  for (size_t i = 0; i < count; ++i) {
+    typename Digest::Context ctx;
+    ctx.Update(data[i], sizes[i]);
+    ctx.Final(digests[i]);
+  }
+}
+
+template<>
+void DigestMany<Sha1>(const unsigned char* const* data, const size_t* sizes,
+                      size_t count, unsigned char* const* digests);
+
+#endif // DIGEST_HPP_
@@ -0,0 +1,107 @@
+#include "entry_spool.hpp"
+
+#include "spilled_hash_set.hpp"
+#include "util/syscall.hpp"
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+const unsigned char kNoDigest[sizeof(ExifHash)] = {};
+
+// how much of the spool is read at a time
+const size_t kReadSize = 1 << 16;
+
+// a record is the hash (as in memory), the size of the path and the path
+struct RecordHeader {
+  ExifHash hash;
+  uint32_t path_size;
+};
+
+} // namespace
+
+EntrySpool::EntrySpool(const std::string& dir)
+    : fd_(OpenSpillFile(dir)),
+      write_offset_(0),
+      flushed_offset_(0),
+      read_pos_(0),
+      read_offset_(0) {}
+
+void EntrySpool::Append(const ExifHasher::Entry& entry) {
+  RecordHeader header;
+  header.hash = entry.hash;
+  header.path_size = entry.path.size();
+  write_buf_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  write_buf_ += entry.path;
+}
+
+// Writes out the entries appended, so that they can be read.
+void EntrySpool::Flush() {
+  for (size_t offset = 0; offset < write_buf_.size(); ) {
+    ssize_t write_count;
+    sys_call_rv(write_count, pwrite, fd_, write_buf_.data() + offset,
+                write_buf_.size() - offset, write_offset_ + offset);
+    offset += write_count;
+  }
+  write_offset_ += write_buf_.size();
+  flushed_offset_ = write_offset_;
+  write_buf_.clear();
+}
+
+// Reads the next count entries (which must have been flushed), linked in
+// order after the entry returned. They stay valid until released.
+const ExifHasher::Entry* EntrySpool::Read(size_t count) {
+  batches_.push_back(std::vector<ExifHasher::Entry>(count + 1));
+  auto& batch = batches_.back();
+  for (size_t i = 1; i <= count; ++i) {
+    RecordHeader header;
+    if (!Fill(sizeof(header)))
+      throw std::runtime_error("unexpected end of spooled entries");
+    memcpy(&header, read_buf_.data() + read_pos_, sizeof(header));
+    read_pos_ += sizeof(header);
+    if (!Fill(header.path_size))
+      throw std::runtime_error("unexpected end of spooled entries");
+
+    auto& entry = batch[i];
+    entry.hash = header.hash;
+    entry.image_hash = ExifHash(kNoDigest);
+    entry.path.assign(read_buf_.data() + read_pos_, header.path_size);
+    read_pos_ += header.path_size;
+    batch[i - 1].next = &entry;
+  }
+  return &batch[0];
+}
+
+// Frees the entries read before the last batch.
+void EntrySpool::Release() {
+  while (batches_.size() > 1)
+    batches_.pop_front();
+}
+
+// Reads ahead (no further than flushed) until at least size bytes past the
+// position are buffered, returning false if the spool ends before.
+bool EntrySpool::Fill(size_t size) {
+  if (read_buf_.size() - read_pos_ >= size)
+    return true;
+  read_buf_.erase(0, read_pos_);
+  read_pos_ = 0;
+  while (read_buf_.size() < size) {
+    size_t buffered = read_buf_.size();
+    read_buf_.resize(buffered + std::min<uint64_t>(
+        std::max(kReadSize, size - buffered),
+        flushed_offset_ - read_offset_));
+    ssize_t read_count;
+    sys_call_rv(read_count, pread, fd_, &read_buf_[buffered],
+                read_buf_.size() - buffered, read_offset_);
+    read_buf_.resize(buffered + read_count);
+    read_offset_ += read_count;
+    if (!read_count)
+      return false;
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef ENTRY_SPOOL_HPP_
+#define ENTRY_SPOOL_HPP_
+
+#include "exif_hasher.hpp"
+#include "util/fd.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+// The entries of a hasher written out to an anonymous file in order, so that
+// the hasher can free them, and read back later a batch at a time. One
+// thread may append while another reads what was flushed before.
+class EntrySpool {
+ public:
+  explicit EntrySpool(const std::string& dir);
+
+  void Append(const ExifHasher::Entry& entry);
+  void Flush();
+
+  const ExifHasher::Entry* Read(size_t count);
+  void Release();
+
+ private:
+  EntrySpool(const EntrySpool&);
+  EntrySpool& operator=(const EntrySpool&);
+
+  bool Fill(size_t size);
+
+  FD fd_;
+  std::string write_buf_;
+  uint64_t write_offset_;
+  std::atomic<uint64_t> flushed_offset_;
+
+  std::string read_buf_;
+  size_t read_pos_;
+  uint64_t read_offset_;
+  // batches read, each after an entry before the first
+  std::deque<std::vector<ExifHasher::Entry> > batches_;
+};
+
+#endif // ENTRY_SPOOL_HPP_
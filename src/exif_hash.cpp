@@ -17,40 +17,41 @@ inline void ToNetworkOrderByte(uint32_t word, void* byte) {
 
 } // namespace
 
-ExifHash::ExifHash() {}
-
-ExifHash::ExifHash(const unsigned char* sha1_digest)
-    : word0(BytesToWord32(sha1_digest + 0)),
-      word1(BytesToWord32(sha1_digest + 4)),
-      word2(BytesToWord32(sha1_digest + 8)),
-      word3(BytesToWord32(sha1_digest + 12)),
-      word4(BytesToWord32(sha1_digest + 16)) {}
-
-std::ostream& operator<<(std::ostream& os, const ExifHash& eh) {
-  os << std::hex << std::setfill('0') <<
-      std::setw(8) << eh.word0 <<
-      std::setw(8) << eh.word1 <<
-      std::setw(8) << eh.word2 <<
-      std::setw(8) << eh.word3 <<
-      std::setw(8) << eh.word4;
-  return os;
+template<typename Digest>
+BasicExifHash<Digest>::BasicExifHash() {}
+
+template<typename Digest>
+BasicExifHash<Digest>::BasicExifHash(const unsigned char* digest) {
+  for (size_t i = 0; i < kWordCount; ++i)
+    words_[i] = BytesToWord32(digest + i * sizeof(uint32_t));
 }
 
-void ExifHash::ToDigest(void* bytes) const {
-  auto sha1_digest = static_cast<unsigned char*>(bytes);
-  ToNetworkOrderByte(word0, sha1_digest + 0);
-  ToNetworkOrderByte(word1, sha1_digest + 4);
-  ToNetworkOrderByte(word2, sha1_digest + 8);
-  ToNetworkOrderByte(word3, sha1_digest + 12);
-  ToNetworkOrderByte(word4, sha1_digest + 16);
+template<typename Digest>
+void BasicExifHash<Digest>::ToDigest(void* bytes) const {
+  auto digest = static_cast<unsigned char*>(bytes);
+  for (size_t i = 0; i < kWordCount; ++i)
+    ToNetworkOrderByte(words_[i], digest + i * sizeof(uint32_t));
 }
 
 namespace std {
 
-size_t hash<ExifHash>::operator()(const ExifHash& ef) const {
+template<typename Digest>
+size_t hash<BasicExifHash<Digest> >::operator()(
+    const BasicExifHash<Digest>& ef) const {
   const size_t prime = 31;
-  return ((((ef.word0 * prime) + ef.word1) * prime + ef.word2) * prime +
-          ef.word3) * prime + ef.word4;
+  size_t h = 0;
+  for (size_t i = 0; i < BasicExifHash<Digest>::kWordCount; ++i)
+    h = h * prime + ef.words_[i];
+  return h;
 }
 
 } // namespace std
+
+template struct BasicExifHash<Sha1>;
+template struct BasicExifHash<Blake2s>;
+template struct std::hash<BasicExifHash<Sha1> >;
+template struct std::hash<BasicExifHash<Blake2s> >;
+#ifdef HAVE_XXHASH
+template struct BasicExifHash<Xxh3>;
+template struct std::hash<BasicExifHash<Xxh3> >;
+#endif
@@ -1,48 +1,92 @@
 #ifndef EXIF_HASH_HPP_
 #define EXIF_HASH_HPP_
 
+#include "digest.hpp"
+
+#include <cstddef>
 #include <cstdint>
 
+#include <functional>
 #include <iomanip>
-#include <iosfwd>
+#include <ostream>
 #include <utility>
 
-struct ExifHash {
+// the digest images are identified by, chosen when building (configure
+// --with-digest), as all peers have to agree on it
+#ifndef EXIF_HASH_DIGEST
+#define EXIF_HASH_DIGEST Sha1
+#endif
+
+template<typename Digest>
+struct BasicExifHash {
  public:
-  ExifHash();
-  ExifHash(const unsigned char* sha1_digest);
+  typedef Digest DigestType;
+  static const size_t kWordCount = Digest::kSize / sizeof(uint32_t);
+
+  BasicExifHash();
+  BasicExifHash(const unsigned char* digest);
 
-  inline friend bool operator==(const ExifHash& lhs, const ExifHash& rhs) {
-    return lhs.word0 == rhs.word0 && lhs.word1 == rhs.word1 &&
-        lhs.word2 == rhs.word2 && lhs.word3 == rhs.word3 &&
-        lhs.word4 == rhs.word4;
+  inline friend bool operator==(const BasicExifHash& lhs,
+                                const BasicExifHash& rhs) {
+    for (size_t i = 0; i < kWordCount; ++i) {
+      if (lhs.words_[i] != rhs.words_[i])
+        return false;
+    }
+    return true;
   }
 
-  inline friend bool operator!=(const ExifHash& lhs, const ExifHash& rhs) {
+  inline friend bool operator!=(const BasicExifHash& lhs,
+                                const BasicExifHash& rhs) {
     return !(lhs == rhs);
   }
 
-  friend std::ostream& operator<<(std::ostream& os, const ExifHash& eh);
+  inline friend bool operator<(const BasicExifHash& lhs,
+                               const BasicExifHash& rhs) {
+    for (size_t i = 0; i < kWordCount; ++i) {
+      if (lhs.words_[i] != rhs.words_[i])
+        return lhs.words_[i] < rhs.words_[i];
+    }
+    return false;
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, const BasicExifHash& eh) {
+    os << std::hex << std::setfill('0');
+    for (size_t i = 0; i < kWordCount; ++i)
+      os << std::setw(8) << eh.words_[i];
+    return os;
+  }
 
   void ToDigest(void* bytes) const;
 
+  // the leading 64 bits, ordered as the whole hashes are
+  uint64_t prefix() const {
+    return (static_cast<uint64_t>(words_[0]) << 32) | words_[1];
+  }
+
  private:
-  uint32_t word0;
-  uint32_t word1;
-  uint32_t word2;
-  uint32_t word3;
-  uint32_t word4;
+  uint32_t words_[kWordCount];
 
-  friend class std::hash<ExifHash>;
+  friend class std::hash<BasicExifHash>;
 };
 
+typedef BasicExifHash<EXIF_HASH_DIGEST> ExifHash;
+
 namespace std {
 
-template<>
-struct hash<ExifHash> {
-  size_t operator()(const ExifHash& ef) const;
+template<typename Digest>
+struct hash<BasicExifHash<Digest> > {
+  size_t operator()(const BasicExifHash<Digest>& ef) const;
 };
 
 } // namespace std
 
+extern template struct BasicExifHash<Sha1>;
+extern template struct BasicExifHash<Blake2s>;
+extern template struct std::hash<BasicExifHash<Sha1> >;
+extern template struct std::hash<BasicExifHash<Blake2s> >;
+#ifdef HAVE_XXHASH
+extern template struct BasicExifHash<Xxh3>;
+extern template struct std::hash<BasicExifHash<Xxh3> >;
+#endif
+
 #endif /* EXIF_HASH_HPP_ */
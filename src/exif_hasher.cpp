@@ -1,29 +1,56 @@
 #include "exif_hasher.hpp"
+#include "header_reader.hpp"
+#include "jpeg.hpp"
 #include "util/fd.hpp"
 #include "util/syscall.hpp"
 
 #include <exiv2/exiv2.hpp>
-#include <openssl/sha.h>
 
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <cstring>
 #include <thread>
 #include <utility>
 
-ExifHasher::Entry::Entry() : next(NULL) {}
-ExifHasher::Entry::Entry(const ExifHash* hash, const std::string& path)
+namespace {
+
+const unsigned char kNoDigest[sizeof(ExifHash)] = {};
+
+// number of images whose EXIF is hashed at once, filling the lanes of the
+// multi-buffer SHA-1 twice
+const size_t kHashBatchSize = 16;
+
+// number of files being opened and read at once (unless set otherwise), and
+// how much of each is read up front: enough for the EXIF segment, which is at
+// most 64 KiB
+const size_t kReadDepth = 128;
+const size_t kHeaderSize = 64 * 1024;
+
+} // namespace
+
+ExifHasher::Entry::Entry() : next(NULL), removed(false) {}
+ExifHasher::Entry::Entry(const ExifHash& hash, const std::string& path)
     : next(NULL),
       hash(hash),
-      path(path) {}
+      image_hash(kNoDigest),
+      path(path),
+      removed(false) {}
+
+ExifHasher::Cursor::Cursor() : entry(NULL), count(0) {}
 
 ExifHasher::ExifHasher()
     : tail_(&dummy_entry_),
-      new_entry_(tail_),
-      new_entry_count_(0),
-      done_(false) {}
+      entry_count_(0),
+      published_count_(0),
+      done_(false),
+      unique_(true),
+      image_hashing_(false),
+      content_hashing_(false),
+      bounded_(false),
+      read_depth_(kReadDepth) {}
 
 ExifHasher::~ExifHasher() {
   auto cur = dummy_entry_.next;
@@ -33,23 +60,74 @@ ExifHasher::~ExifHasher() {
   }
 }
 
-bool ExifHasher::HashExif(const std::string& path,
-                          unsigned char* sha1_hash) const {
-  FD fd;
-  sys_call_rv(fd, open, path.c_str(), O_RDONLY);
+bool ExifHasher::HashExif(const std::string& path, unsigned char* digest,
+                          unsigned char* image_digest) const {
+  std::string exif;
+  if (!ReadExif(path, &exif, digest, image_digest))
+    return false;
+  if (!exif.empty()) {
+    ExifHash::DigestType::Context ctx;
+    ctx.Update(exif.data(), exif.size());
+    ctx.Final(digest);
+  }
+  return true;
+}
+
+// Serializes the EXIF of the image for hashing, or (if it has none, with
+// content hashing) leaves exif empty and hashes the whole image into digest
+// right away. Returns false if the image cannot be identified either way.
+bool ExifHasher::ReadExif(const std::string& path, std::string* exif,
+                          unsigned char* digest,
+                          unsigned char* image_digest) const {
+  int file_fd;
+  sys_call_rv(file_fd, open, path.c_str(), O_RDONLY);
+  FD fd = file_fd;
   struct stat stat_buf;
   sys_call(fstat, fd, &stat_buf);
   void* memblock;
   sys_call2_rv(NULL, memblock, mmap, NULL, stat_buf.st_size, PROT_READ,
                MAP_PRIVATE, fd, 0);
-  auto bytes = static_cast<const unsigned char*>(memblock);
+  if (content_hashing_)
+    madvise(memblock, stat_buf.st_size, MADV_SEQUENTIAL);
+
+  auto parse = ParseExif(static_cast<const unsigned char*>(memblock),
+                         stat_buf.st_size, true, path, exif, digest,
+                         image_digest);
+  sys_call(munmap, memblock, stat_buf.st_size);
+  return parse == kIdentified;
+}
+
+// As above, but from the start of the file read ahead, if that is enough.
+bool ExifHasher::ReadExif(const HeaderReader::Header& header,
+                          std::string* exif, unsigned char* digest,
+                          unsigned char* image_digest) const {
+  if (!header.error) {
+    auto parse = ParseExif(header.bytes.data(), header.bytes.size(),
+                           header.whole, header.path, exif, digest,
+                           image_digest);
+    if (parse != kNeedsWholeFile)
+      return parse == kIdentified;
+  }
+  // an error is reported (thrown) the same way as for any other read
+  return ReadExif(header.path, exif, digest, image_digest);
+}
+
+// Identifies the image from its bytes as ReadExif, unless they are not the
+// whole file and do not have everything needed: all of the metadata for the
+// EXIF, and the whole file for image or content hashing.
+ExifHasher::Parse ExifHasher::ParseExif(
+    const unsigned char* bytes, size_t size, bool whole,
+    const std::string& path, std::string* exif, unsigned char* digest,
+    unsigned char* image_digest) const {
+  if (!whole && (image_digest != NULL || !FindScan(bytes, size)))
+    return kNeedsWholeFile;
 
   Exiv2::Image::AutoPtr image;
   try {
-    image = Exiv2::ImageFactory::open(bytes, stat_buf.st_size);
+    image = Exiv2::ImageFactory::open(bytes, size);
   } catch (const std::exception& e) {
     std::cerr << "Error: " << e.what() << std::endl;
-    return false;
+    return kUnidentified;
   }
 
   if (image.get() != 0)
@@ -57,11 +135,20 @@ bool ExifHasher::HashExif(const std::string& path,
   else
     std::cerr << "Warning: EXIF not found in: " << path << std::endl;
 
-  sys_call(munmap, memblock, stat_buf.st_size);
-  fd.Close();
+  // the image data has to be hashed while the file is still mapped
+  if (image_digest != NULL && !HashImageData(bytes, size, image_digest))
+    memcpy(image_digest, kNoDigest, sizeof(kNoDigest));
 
   if (image.get() == 0)
-    return false;
+    return kUnidentified;
+
+  // identify an image without EXIF by its whole content instead, if asked to
+  if (content_hashing_ && image->exifData().empty()) {
+    if (!whole)
+      return kNeedsWholeFile;
+    HashContent(bytes, size, digest);
+    return kIdentified;
+  }
 
   const auto& exifData = image->exifData();
   if (!exifData.empty()) {
@@ -72,84 +159,306 @@ bool ExifHasher::HashExif(const std::string& path,
       //     i->value() << std::endl;
       oss << i->key() << i->value();
     }
-    const std::string& exif_str = oss.str();
-    SHA1(reinterpret_cast<const unsigned char*>(exif_str.c_str()),
-         exif_str.size(), sha1_hash);
-    return true;
+    *exif = oss.str();
+    return kIdentified;
   } else {
     std::cerr << "Warning: EXIF not found in: " << path << std::endl;
   }
 
-  return false;
+  return kUnidentified;
 }
 
 void ExifHasher::Run(size_t progress_threshold,
                      std::function<const char*(void)> path_gen,
                      bool unique) {
-  std::thread thr([this, path_gen, progress_threshold, unique] {
-      unsigned char hash_buf[SHA_DIGEST_LENGTH];
-      std::string path;
+  unique_ = unique;
+  std::thread thr([this, path_gen, progress_threshold] {
+      // images whose hash is known are appended without being read at all
+      // (unless their image data has to be hashed as well)
+      auto unknown_path_gen = [this, path_gen, progress_threshold] {
+        const char* path;
+        ExifHash hash;
+        while (*(path = path_gen()) && hash_lookup_ && !image_hashing_ &&
+               hash_lookup_(path, &hash)) {
+          std::unique_lock<decltype(mutex_)> locker(mutex_);
+          if (Append(hash, path, ExifHash(kNoDigest)))
+            Publish(progress_threshold);
+        }
+        return path;
+      };
+      HeaderReader reader(unknown_path_gen, read_depth_, kHeaderSize);
+      HeaderReader::Header header;
+
+      // the EXIF of a batch of images is hashed at once (see DigestMany)
+      struct Image {
+        std::string path;
+        std::string exif;
+        unsigned char hash_buf[sizeof(ExifHash)];
+        unsigned char image_hash_buf[sizeof(ExifHash)];
+      } batch[kHashBatchSize];
+      const unsigned char* data[kHashBatchSize];
+      size_t sizes[kHashBatchSize];
+      unsigned char* digests[kHashBatchSize];
+
+      size_t batch_size = 0;
+      bool more = true;
       DEBUG_OUT_LN(RUN, "BEGIN");
-      while (!path.replace(0, std::string::npos, path_gen()).empty()) {
-        DEBUG_OUT_LN(RUN, "path=%s | PROCESSING", path.c_str());
-        if (!HashExif(path, hash_buf))
-          continue;
-
-        ExifHash h(hash_buf);
-        if (unique && hashes_.count(h)) {
-          std::cerr << "Exif hash conflict in: " << path << std::endl;
-          // TODO
-          continue;
+      while (more) {
+        auto& image = batch[batch_size];
+        more = reader.Next(&header);
+        if (more) {
+          image.path = header.path;
+          DEBUG_OUT_LN(RUN, "path=%s | PROCESSING", image.path.c_str());
+          image.exif.clear();
+          bool identified;
+          try {
+            identified = ReadExif(header, &image.exif, image.hash_buf,
+                                  image_hashing_ ? image.image_hash_buf :
+                                  NULL);
+          } catch (const SysCallException& e) {
+            // skip a file that cannot be read, rather than all the others
+            std::cerr << "Error: " << e.what() << " in: " << image.path
+                      << std::endl;
+            identified = false;
+          }
+          if (!identified || ++batch_size < kHashBatchSize)
+            continue;
         }
 
-        tail_ = (tail_->next = new Entry(&*hashes_.insert(h).first, path));
-        if (hashes_.size() % progress_threshold == 0) {
-          std::unique_lock<decltype(mutex_)> locker(mutex_);
-          new_entry_count_ += progress_threshold;
-          DEBUG_OUT_LN(RUN, "NOTIFY(%s)", DEBUG_STR(new_entry_count_));
-          new_entries_.notify_one();
+        size_t exif_count = 0;
+        for (size_t i = 0; i < batch_size; ++i) {
+          if (batch[i].exif.empty()) // hashed by content already
+            continue;
+          data[exif_count] = reinterpret_cast<const unsigned char*>(
+              batch[i].exif.data());
+          sizes[exif_count] = batch[i].exif.size();
+          digests[exif_count++] = batch[i].hash_buf;
+        }
+        DigestMany<ExifHash::DigestType>(data, sizes, exif_count, digests);
+
+        std::unique_lock<decltype(mutex_)> locker(mutex_);
+        for (size_t i = 0; i < batch_size; ++i) {
+          const auto& image = batch[i];
+          if (!Append(ExifHash(image.hash_buf), image.path,
+                      ExifHash(image_hashing_ ? image.image_hash_buf :
+                               kNoDigest))) {
+            continue;
+          }
+          DEBUG_OUT_LN(RUN, "hash=%s; path=%s", DEBUG_STR(tail_->hash),
+                       image.path.c_str());
         }
-        DEBUG_OUT_LN(RUN, "hash=%s; path=%s", DEBUG_STR(*tail_->hash),
-                     path.c_str());
+        batch_size = 0;
+        Publish(progress_threshold);
       }
 
       {
         std::unique_lock<decltype(mutex_)> locker(mutex_);
-        new_entry_count_ += hashes_.size() % progress_threshold;
+        published_count_ = entry_count_;
         done_ = true;
         DEBUG_OUT_LN(RUN, "DONE");
-        DEBUG_OUT_LN(RUN, "NOTIFY(%s)", DEBUG_STR(new_entry_count_));
-        new_entries_.notify_one();
+        DEBUG_OUT_LN(RUN, "NOTIFY(%s)", DEBUG_STR(published_count_));
+        new_entries_.notify_all();
       }
     });
   thr.detach();
 }
 
 const ExifHasher::Entry* ExifHasher::Get(size_t* count) {
+  return Get(&cursor_, count);
+}
+
+// Waits until count entries past the cursor are found (or hashing is done),
+// then advances the cursor over them and returns the first one.
+const ExifHasher::Entry* ExifHasher::Get(Cursor* cursor, size_t* count) {
   {
     std::unique_lock<decltype(mutex_)> locker(mutex_);
     DEBUG_OUT_LN(GET, "WAIT BEGIN(%s)", DEBUG_STR(*count));
-    new_entries_.wait(locker, [this, &count] {
-        return new_entry_count_ >= *count || done_;
+    new_entries_.wait(locker, [this, cursor, count] {
+        return published_count_ - cursor->count >= *count || done_;
       });
-    *count = std::min(*count, new_entry_count_);
+    *count = std::min(*count, published_count_ - cursor->count);
     DEBUG_OUT_LN(GET, "WAIT END(%s / %s)", DEBUG_STR(*count),
-                 DEBUG_STR(new_entry_count_));
-    new_entry_count_ -= *count;
+                 DEBUG_STR(published_count_ - cursor->count));
   }
 
-  auto begin = new_entry_->next;
+  if (cursor->entry == NULL)
+    cursor->entry = &dummy_entry_;
+  auto begin = cursor->entry->next;
   for (size_t i = 0; i < *count; ++i)
-    new_entry_ = new_entry_->next;
+    cursor->entry = cursor->entry->next;
+  cursor->count += *count;
   return begin;
 }
 
+// Hashes the image at path and appends it, publishing it right away.
+bool ExifHasher::Add(const std::string& path) {
+  unsigned char hash_buf[sizeof(ExifHash)];
+  unsigned char image_hash_buf[sizeof(ExifHash)];
+  if (!HashExif(path, hash_buf, image_hashing_ ? image_hash_buf : NULL))
+    return false;
+
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  if (!Append(ExifHash(hash_buf), path,
+              ExifHash(image_hashing_ ? image_hash_buf : kNoDigest))) {
+    return false;
+  }
+  published_count_ = entry_count_;
+  new_entries_.notify_all();
+  return true;
+}
+
+// Appends an image whose hash is already known, publishing it right away.
+bool ExifHasher::Add(const ExifHash& hash, const std::string& path) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  if (!Append(hash, path, ExifHash(kNoDigest)))
+    return false;
+  published_count_ = entry_count_;
+  new_entries_.notify_all();
+  return true;
+}
+
+// Drops the images at the paths (e.g. deleted since they were hashed), so
+// that their hashes are no longer found, unless other images (not unique)
+// still have them. Their entries stay in place for the readers going through
+// them, marked as removed. Returns the number dropped.
+size_t ExifHasher::Remove(const std::unordered_set<std::string>& paths) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  std::unordered_set<ExifHash> hashes;
+  size_t count = 0;
+  for (auto entry = dummy_entry_.next; entry != NULL; entry = entry->next) {
+    if (entry->removed || !paths.count(entry->path))
+      continue;
+    entry->removed = true;
+    hashes.insert(entry->hash);
+    auto it = image_entries_.find(entry->image_hash);
+    if (it != image_entries_.end() && it->second == entry)
+      image_entries_.erase(it);
+    ++count;
+  }
+  if (!count)
+    return 0;
+
+  // keep the hashes (and image hashes) of the images still there
+  for (auto entry = dummy_entry_.next; entry != NULL; entry = entry->next) {
+    if (entry->removed)
+      continue;
+    hashes.erase(entry->hash);
+    if (entry->image_hash != ExifHash(kNoDigest))
+      image_entries_.insert(std::make_pair(entry->image_hash, entry));
+  }
+  if (!bounded_) {
+    for (const auto& hash : hashes)
+      hashes_.Erase(hash);
+  }
+  return count;
+}
+
+// Waits until Run is done with all paths.
+void ExifHasher::Wait() {
+  std::unique_lock<decltype(mutex_)> locker(mutex_);
+  new_entries_.wait(locker, [this] { return done_; });
+}
+
+// Waits until more than count entries are published (or the timeout passes),
+// returning the number published.
+size_t ExifHasher::WaitFor(size_t count, std::chrono::milliseconds timeout) {
+  std::unique_lock<decltype(mutex_)> locker(mutex_);
+  new_entries_.wait_for(locker, timeout, [this, count] {
+      return published_count_ > count;
+    });
+  return published_count_;
+}
+
 bool ExifHasher::Contains(const ExifHash& hash) const {
-  return hashes_.count(hash);
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  return hashes_.Contains(hash);
+}
+
+// Sets the bits of the bitmask for the hashes found (see HashIndex).
+void ExifHasher::ContainsBatch(const ExifHash* hashes, size_t count,
+                               unsigned char* bitmask) const {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  hashes_.ContainsBatch(hashes, count, bitmask);
+}
+
+// Returns an entry whose image data (not metadata) has the given hash.
+const ExifHasher::Entry* ExifHasher::FindImage(
+    const ExifHash& image_hash) const {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  auto it = image_entries_.find(image_hash);
+  return it != image_entries_.end() ? it->second : NULL;
+}
+
+// Frees the entries before the given one, which all readers are past (with
+// memory bounded, the hashes are kept elsewhere).
+void ExifHasher::Release(const Entry* entry) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  if (entry == &dummy_entry_)
+    return;
+  for (auto cur = dummy_entry_.next; cur != entry; ) {
+    auto next = cur->next;
+    if (cur->image_hash != ExifHash(kNoDigest))
+      image_entries_.erase(cur->image_hash);
+    delete cur;
+    cur = next;
+  }
+  dummy_entry_.next = const_cast<Entry*>(entry);
 }
 
 const ExifHasher::Entry* ExifHasher::before_first_entry() const {
   return &dummy_entry_;
 }
 
-size_t ExifHasher::entry_count() const { return hashes_.size(); }
+size_t ExifHasher::entry_count() const {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  return bounded_ ? entry_count_ : hashes_.size();
+}
+
+void ExifHasher::set_image_hashing(bool image_hashing) {
+  image_hashing_ = image_hashing;
+}
+
+void ExifHasher::set_content_hashing(bool content_hashing) {
+  content_hashing_ = content_hashing;
+}
+
+void ExifHasher::set_hash_lookup(HashLookup hash_lookup) {
+  hash_lookup_ = hash_lookup;
+}
+
+// Keeps no index of the hashes, so that Contains finds none and none are
+// rejected as repeated (for memory bounded by releasing the entries).
+void ExifHasher::set_bounded(bool bounded) { bounded_ = bounded; }
+
+// Sets the number of files read at once by Run, each taking a descriptor.
+void ExifHasher::set_read_depth(size_t read_depth) {
+  read_depth_ = read_depth;
+}
+
+// Links a new last entry, unless the hash is taken and must be unique.
+// Must be called with mutex_ held.
+bool ExifHasher::Append(const ExifHash& hash, const std::string& path,
+                        const ExifHash& image_hash) {
+  if (!bounded_ && !hashes_.Insert(hash) && unique_) {
+    std::cerr << "Exif hash conflict in: " << path << std::endl;
+    // TODO
+    return false;
+  }
+
+  tail_ = (tail_->next = new Entry(hash, path));
+  tail_->image_hash = image_hash;
+  if (image_hash != ExifHash(kNoDigest))
+    image_entries_.insert(std::make_pair(image_hash, tail_));
+  ++entry_count_;
+  return true;
+}
+
+// Publishes the entries appended, once there are progress_threshold of them.
+// Must be called with mutex_ held.
+void ExifHasher::Publish(size_t progress_threshold) {
+  if (entry_count_ - published_count_ >= progress_threshold) {
+    published_count_ = entry_count_;
+    DEBUG_OUT_LN(RUN, "NOTIFY(%s)", DEBUG_STR(published_count_));
+    new_entries_.notify_all();
+  }
+}
@@ -2,24 +2,42 @@
 #define EXIF_HASHER_HPP_
 
 #include "exif_hash.hpp"
+#include "hash_index.hpp"
+#include "header_reader.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 class ExifHasher {
  public:
   struct Entry {
     Entry* next;
-    const ExifHash* hash;
+    ExifHash hash;
+    ExifHash image_hash; // all zero unless image hashing is enabled
     std::string path;
+    std::atomic<bool> removed; // since the image was gone (see Remove)
 
     Entry();
-    Entry(const ExifHash* hash, const std::string& path);
+    Entry(const ExifHash& hash, const std::string& path);
   };
 
+  // Position of one reader of the entries, so that several can Get them.
+  struct Cursor {
+    Cursor();
+
+    const Entry* entry; // the last one gotten, or NULL
+    size_t count;
+  };
+
+  // tells the hash of the image at a path, if known without reading it
+  typedef std::function<bool(const char* path, ExifHash* hash)> HashLookup;
+
   ExifHasher();
   virtual ~ExifHasher();
 
@@ -27,26 +45,63 @@ class ExifHasher {
            std::function<const char*(void)> path_gen,
            bool unique = true);
   const Entry* Get(size_t* count);
+  const Entry* Get(Cursor* cursor, size_t* count);
+  bool Add(const std::string& path);
+  bool Add(const ExifHash& hash, const std::string& path);
+  size_t Remove(const std::unordered_set<std::string>& paths);
+  void Wait();
+  size_t WaitFor(size_t count, std::chrono::milliseconds timeout);
   bool Contains(const ExifHash& hash) const;
+  void ContainsBatch(const ExifHash* hashes, size_t count,
+                     unsigned char* bitmask) const;
+  const Entry* FindImage(const ExifHash& image_hash) const;
+  void Release(const Entry* entry);
 
   const Entry* before_first_entry() const;
   size_t entry_count() const;
+  void set_image_hashing(bool image_hashing);
+  void set_content_hashing(bool content_hashing);
+  void set_hash_lookup(HashLookup hash_lookup);
+  void set_bounded(bool bounded);
+  void set_read_depth(size_t read_depth);
 
  protected:
-  virtual bool HashExif(const std::string& path,
-                        unsigned char* sha1_hash) const;
+  virtual bool HashExif(const std::string& path, unsigned char* digest,
+                        unsigned char* image_digest = NULL) const;
+  bool ReadExif(const std::string& path, std::string* exif,
+                unsigned char* digest, unsigned char* image_digest) const;
+  bool ReadExif(const HeaderReader::Header& header, std::string* exif,
+                unsigned char* digest, unsigned char* image_digest) const;
 
  private:
+  // how far the image could be identified from the bytes given
+  enum Parse { kIdentified, kUnidentified, kNeedsWholeFile };
+
+  Parse ParseExif(const unsigned char* bytes, size_t size, bool whole,
+                  const std::string& path, std::string* exif,
+                  unsigned char* digest, unsigned char* image_digest) const;
+  bool Append(const ExifHash& hash, const std::string& path,
+              const ExifHash& image_hash);
+  void Publish(size_t progress_threshold);
+
   Entry dummy_entry_;
   Entry* tail_;
-  const Entry* new_entry_;
+  Cursor cursor_;
 
-  std::mutex mutex_;
+  mutable std::mutex mutex_;
   std::condition_variable new_entries_;
-  size_t new_entry_count_;
+  size_t entry_count_;
+  size_t published_count_;
   bool done_;
+  bool unique_;
 
-  std::unordered_set<ExifHash> hashes_;
+  HashIndex hashes_;
+  std::unordered_map<ExifHash, const Entry*> image_entries_;
+  bool image_hashing_;
+  bool content_hashing_;
+  HashLookup hash_lookup_;
+  bool bounded_; // keeping no index of the hashes (nor uniqueness)
+  size_t read_depth_; // number of files being read at once
 };
 
 #endif // EXIF_HASHER_HPP_
@@ -0,0 +1,116 @@
+#include "frozen_hash_set.hpp"
+
+#include <algorithm>
+
+namespace {
+
+const size_t kCacheLineSize = 64;
+// number of prefixes in a cache line: the descendants three levels down
+const size_t kLinePrefixCount = kCacheLineSize / sizeof(uint64_t);
+
+} // namespace
+
+const size_t FrozenHashSet::kMaxBatch;
+
+FrozenHashSet::FrozenHashSet()
+    : size_(0),
+      depth_(0),
+      prefixes_(NULL) {}
+
+// Takes over the hashes (in any order, possibly repeated) and lays them out.
+FrozenHashSet::FrozenHashSet(std::vector<ExifHash>* hashes) {
+  std::sort(hashes->begin(), hashes->end());
+  hashes->erase(std::unique(hashes->begin(), hashes->end()), hashes->end());
+  size_ = hashes->size();
+  for (depth_ = 0; size_ >> depth_; ++depth_)
+    ;
+
+  prefix_buf_.resize(size_ + 1 + kLinePrefixCount);
+  auto addr = reinterpret_cast<uintptr_t>(&prefix_buf_[0]);
+  prefixes_ = reinterpret_cast<uint64_t*>(
+      (addr + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize);
+  hashes_.resize(size_ + 1);
+  Fill(*hashes, 0, 1);
+
+  std::vector<ExifHash>().swap(*hashes);
+}
+
+bool FrozenHashSet::Contains(const ExifHash& hash) const {
+  uint64_t prefix = hash.prefix();
+  size_t k = 1;
+  while (k <= size_) {
+    __builtin_prefetch(prefixes_ + kLinePrefixCount * k);
+    k = 2 * k + (prefixes_[k] < prefix);
+  }
+  return Find(hash, k);
+}
+
+// Looks up at most kMaxBatch hashes, setting whether each is found.
+void FrozenHashSet::ContainsBatch(const ExifHash* const* hashes, size_t count,
+                                  bool* found) const {
+  uint64_t prefixes[kMaxBatch];
+  size_t ks[kMaxBatch];
+  for (size_t i = 0; i < count; ++i) {
+    prefixes[i] = hashes[i]->prefix();
+    ks[i] = 1;
+  }
+
+  // all paths are as long as the tree is deep, but maybe for the last level
+  for (size_t level = 0; level < depth_; ++level) {
+    for (size_t i = 0; i < count; ++i) {
+      size_t k = ks[i];
+      if (k > size_)
+        continue;
+      __builtin_prefetch(prefixes_ + kLinePrefixCount * k);
+      ks[i] = 2 * k + (prefixes_[k] < prefixes[i]);
+    }
+  }
+  for (size_t i = 0; i < count; ++i)
+    found[i] = Find(*hashes[i], ks[i]);
+}
+
+size_t FrozenHashSet::size() const { return size_; }
+
+void FrozenHashSet::swap(FrozenHashSet& other) {
+  std::swap(size_, other.size_);
+  std::swap(depth_, other.depth_);
+  prefix_buf_.swap(other.prefix_buf_);
+  std::swap(prefixes_, other.prefixes_);
+  hashes_.swap(other.hashes_);
+}
+
+// Places the sorted hashes from ind on in the subtree rooted at k (in order),
+// returning the index of the first hash left.
+size_t FrozenHashSet::Fill(const std::vector<ExifHash>& sorted, size_t ind,
+                           size_t k) {
+  if (k > size_)
+    return ind;
+  ind = Fill(sorted, ind, 2 * k);
+  prefixes_[k] = sorted[ind].prefix();
+  hashes_[k] = sorted[ind++];
+  return Fill(sorted, ind, 2 * k + 1);
+}
+
+// Returns whether the hash is in the set, given the path k walked down to
+// the first prefix not less than its own: what is left of the path after
+// dropping the right turns following that one.
+bool FrozenHashSet::Find(const ExifHash& hash, size_t k) const {
+  uint64_t prefix = hash.prefix();
+  // hashes rarely share a prefix, but those that do follow in order
+  for (k >>= __builtin_ffsl(~k); k != 0 && prefixes_[k] == prefix;
+       k = Successor(k)) {
+    if (hashes_[k] == hash)
+      return true;
+  }
+  return false;
+}
+
+// Returns the index of the next hash in order after the one at k, or 0.
+size_t FrozenHashSet::Successor(size_t k) const {
+  if (2 * k + 1 <= size_) {
+    for (k = 2 * k + 1; 2 * k <= size_; k *= 2)
+      ;
+    return k;
+  }
+  return k >> __builtin_ffsl(~k);
+}
@@ -0,0 +1,46 @@
+#ifndef FROZEN_HASH_SET_HPP_
+#define FROZEN_HASH_SET_HPP_
+
+#include "exif_hash.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+// A set of hashes that no longer changes, laid out for lookups: sorted in the
+// order of a breadth-first walk of a balanced search tree (the Eytzinger
+// layout), so that a lookup reads one path down from the root, compares
+// without branching and prefetches the levels below. The leading bits of the
+// hashes are searched in an array of their own, eight to a cache line.
+// Looking up a batch of hashes walks their paths in lockstep, so that the
+// cache misses of all of them overlap.
+class FrozenHashSet {
+ public:
+  static const size_t kMaxBatch = 16;
+
+  FrozenHashSet();
+  explicit FrozenHashSet(std::vector<ExifHash>* hashes);
+
+  bool Contains(const ExifHash& hash) const;
+  void ContainsBatch(const ExifHash* const* hashes, size_t count,
+                     bool* found) const;
+  size_t size() const;
+  void swap(FrozenHashSet& other);
+
+ private:
+  FrozenHashSet(const FrozenHashSet&);
+  FrozenHashSet& operator=(const FrozenHashSet&);
+
+  size_t Fill(const std::vector<ExifHash>& sorted, size_t ind, size_t k);
+  bool Find(const ExifHash& hash, size_t k) const;
+  size_t Successor(size_t k) const;
+
+  size_t size_;
+  size_t depth_; // of the tree, counting the root
+  std::vector<uint64_t> prefix_buf_;
+  uint64_t* prefixes_; // 1-based, the first of every 8 cache line aligned
+  std::vector<ExifHash> hashes_; // 1-based as well
+};
+
+#endif // FROZEN_HASH_SET_HPP_
@@ -0,0 +1,118 @@
+#include "hash_index.hpp"
+
+#include <climits>
+
+namespace {
+
+const unsigned kInitialSlotBits = 10;
+
+const ExifHash& Zero() {
+  static const unsigned char kZeroDigest[sizeof(ExifHash)] = {};
+  static const ExifHash kZero(kZeroDigest);
+  return kZero;
+}
+
+} // namespace
+
+HashIndex::HashIndex()
+    : slots_(size_t(1) << kInitialSlotBits, Zero()),
+      shift_(64 - kInitialSlotBits),
+      size_(0),
+      has_zero_(false) {}
+
+// Adds the hash, returning false if it is in the set already.
+bool HashIndex::Insert(const ExifHash& hash) {
+  if (hash == Zero()) {
+    if (has_zero_)
+      return false;
+    ++size_;
+    return has_zero_ = true;
+  }
+
+  // keep at least half of the slots empty, so that probe runs stay short
+  if (2 * (size_ + 1) > slots_.size())
+    Grow();
+  size_t slot;
+  if (Find(hash, &slot))
+    return false;
+  slots_[slot] = hash;
+  ++size_;
+  return true;
+}
+
+// Removes the hash, returning false if it is not in the set.
+bool HashIndex::Erase(const ExifHash& hash) {
+  if (hash == Zero()) {
+    if (!has_zero_)
+      return false;
+    --size_;
+    has_zero_ = false;
+    return true;
+  }
+
+  size_t slot;
+  if (!Find(hash, &slot))
+    return false;
+  // move back the later hashes of the probe run that may fill the hole (those
+  // whose home slot is not between it and them), so that all stay reachable
+  size_t mask = slots_.size() - 1;
+  for (size_t i = (slot + 1) & mask; slots_[i] != Zero(); i = (i + 1) & mask) {
+    if (((i - Home(slots_[i])) & mask) >= ((i - slot) & mask)) {
+      slots_[slot] = slots_[i];
+      slot = i;
+    }
+  }
+  slots_[slot] = Zero();
+  --size_;
+  return true;
+}
+
+bool HashIndex::Contains(const ExifHash& hash) const {
+  size_t slot;
+  return hash == Zero() ? has_zero_ : Find(hash, &slot);
+}
+
+// Sets bit i (of byte i / CHAR_BIT) of the bitmask for each of the hashes
+// that is in the set, leaving the other bits alone.
+void HashIndex::ContainsBatch(const ExifHash* hashes, size_t count,
+                              unsigned char* bitmask) const {
+  // start fetching all the home slots first, so that their misses overlap
+  for (size_t i = 0; i < count; ++i)
+    __builtin_prefetch(&slots_[Home(hashes[i])]);
+  for (size_t i = 0; i < count; ++i) {
+    if (Contains(hashes[i]))
+      bitmask[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+  }
+}
+
+size_t HashIndex::size() const { return size_; }
+
+size_t HashIndex::Home(const ExifHash& hash) const {
+  return hash.prefix() >> shift_;
+}
+
+// Finds the slot of the (non-zero) hash, or else the empty slot for it.
+bool HashIndex::Find(const ExifHash& hash, size_t* slot) const {
+  size_t mask = slots_.size() - 1;
+  for (size_t i = Home(hash); ; i = (i + 1) & mask) {
+    if (slots_[i] == hash) {
+      *slot = i;
+      return true;
+    }
+    if (slots_[i] == Zero()) {
+      *slot = i;
+      return false;
+    }
+  }
+}
+
+void HashIndex::Grow() {
+  std::vector<ExifHash> slots(2 * slots_.size(), Zero());
+  slots.swap(slots_);
+  --shift_;
+  for (const auto& hash : slots) {
+    size_t slot;
+    if (hash != Zero() && !Find(hash, &slot))
+      slots_[slot] = hash;
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef HASH_INDEX_HPP_
+#define HASH_INDEX_HPP_
+
+#include "exif_hash.hpp"
+
+#include <cstddef>
+
+#include <vector>
+
+// A set of hashes in one flat table (open addressing, probed linearly), each
+// placed by its leading bits, which are as good as random. So a lookup takes
+// a single cache miss, and a batch of lookups can prefetch all their slots
+// first. The all-zero hash marks the empty slots, so it is kept aside.
+class HashIndex {
+ public:
+  HashIndex();
+
+  bool Insert(const ExifHash& hash);
+  bool Erase(const ExifHash& hash);
+  bool Contains(const ExifHash& hash) const;
+  void ContainsBatch(const ExifHash* hashes, size_t count,
+                     unsigned char* bitmask) const;
+  size_t size() const;
+
+ private:
+  size_t Home(const ExifHash& hash) const;
+  bool Find(const ExifHash& hash, size_t* slot) const;
+  void Grow();
+
+  std::vector<ExifHash> slots_;
+  unsigned shift_; // of the prefix, leaving the home slot
+  size_t size_;
+  bool has_zero_;
+};
+
+#endif // HASH_INDEX_HPP_
@@ -0,0 +1,137 @@
+#include "hasher_pool.hpp"
+
+#include "util/syscall.hpp"
+
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+// at most this many hashers run at once, each with its own reads in flight
+const size_t kMaxHasherCount = 16;
+// number of files each hasher reads at once, if the descriptors allow
+const size_t kMaxReadDepth = 128;
+// descriptors left for anything but the reads in flight: the standard
+// streams, the directories walked, and what each hasher opens besides
+const size_t kReservedFdCount = 32;
+const size_t kReservedHasherFdCount = 2;
+// number of hashes a hasher publishes (and its thread takes) at a time
+const size_t kBatchSize = 64;
+// number of directory entries hashed in inode (roughly disk) order at a time
+const size_t kScanWindow = 8192;
+
+bool IsJpeg(const std::string& path) {
+  size_t pos = path.rfind('.');
+  return pos != std::string::npos &&
+      (strcasecmp(path.c_str() + pos, ".jpg") == 0 ||
+       strcasecmp(path.c_str() + pos, ".jpeg") == 0);
+}
+
+// Returns how many files each of the hashers can read at once without running
+// out of descriptors.
+size_t ReadDepth(size_t hasher_count) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1 ||
+      limit.rlim_cur == RLIM_INFINITY) {
+    return kMaxReadDepth;
+  }
+  size_t reserved = kReservedFdCount + kReservedHasherFdCount * hasher_count;
+  if (limit.rlim_cur <= reserved + hasher_count)
+    return 1;
+  return std::min<size_t>((limit.rlim_cur - reserved) / hasher_count,
+                          kMaxReadDepth);
+}
+
+} // namespace
+
+PathSource::PathSource(char** roots, size_t root_count)
+    : roots_(roots),
+      root_count_(root_count),
+      root_ind_(0) {}
+
+bool PathSource::Next(std::string* path) {
+  std::lock_guard<std::mutex> locker(mutex_);
+  while (true) {
+    if (dir_ != NULL) {
+      try {
+        const std::string& next = dir_->Next();
+        if (!next.empty()) {
+          if (IsJpeg(next)) {
+            *path = next;
+            return true;
+          }
+          continue;
+        }
+      } catch (const SysCallException& e) {
+        std::cerr << "Warning: " << e.what() << std::endl;
+      }
+      dir_.reset();
+    }
+
+    if (root_ind_ == root_count_)
+      return false;
+    const char* root = roots_[root_ind_++];
+    struct stat stat_buf;
+    if (stat(root, &stat_buf) == -1 || !S_ISDIR(stat_buf.st_mode)) {
+      *path = root;
+      return true;
+    }
+    try {
+      dir_.reset(new Dir(root, true, kScanWindow));
+    } catch (const SysCallException& e) {
+      std::cerr << "Warning: " << e.what() << std::endl;
+    }
+  }
+}
+
+// Starts hashing the images of the source (keeping those with a hash found
+// before, unless unique).
+HasherPool::HasherPool(PathSource* path_source, bool unique) {
+  size_t hasher_count = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1U), kMaxHasherCount);
+  size_t read_depth = ReadDepth(hasher_count);
+  for (size_t i = 0; i < hasher_count; ++i) {
+    hashers_.push_back(std::unique_ptr<ExifHasher>(new ExifHasher()));
+    hashers_.back()->set_read_depth(read_depth);
+    auto path = std::make_shared<std::string>(); // kept while it is read
+    hashers_.back()->Run(kBatchSize, [path_source, path] {
+        return path_source->Next(path.get()) ? path->c_str() : "";
+      }, unique);
+  }
+}
+
+// Hands each image hashed to the handler (on the thread of its hasher),
+// writing what it prints to os a batch at a time, until all are hashed.
+void HasherPool::Run(Handler handler, std::ostream* os) {
+  std::mutex os_mutex;
+  std::vector<std::thread> threads;
+  for (auto& hasher : hashers_) {
+    ExifHasher* exif_hasher = hasher.get();
+    threads.push_back(std::thread([&, exif_hasher] {
+          std::ostringstream oss;
+          while (true) {
+            size_t count = kBatchSize;
+            auto e = exif_hasher->Get(&count);
+            if (!count)
+              break;
+            for (; count--; e = e->next)
+              handler(*e, &oss);
+            if (oss.tellp() > 0) {
+              std::lock_guard<std::mutex> locker(os_mutex);
+              *os << oss.str();
+              oss.str("");
+            }
+          }
+        }));
+  }
+  for (auto& thread : threads)
+    thread.join();
+  os->flush();
+}
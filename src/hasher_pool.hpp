@@ -0,0 +1,50 @@
+#ifndef HASHER_POOL_HPP_
+#define HASHER_POOL_HPP_
+
+#include "exif_hasher.hpp"
+#include "util/dir.hpp"
+
+#include <cstddef>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Hands out the images under the roots (files taken as they are, directories
+// walked recursively for *.jpg) to any number of threads.
+class PathSource {
+ public:
+  PathSource(char** roots, size_t root_count);
+
+  bool Next(std::string* path);
+
+ private:
+  std::mutex mutex_;
+  char** roots_;
+  size_t root_count_;
+  size_t root_ind_;
+  std::unique_ptr<Dir> dir_;
+};
+
+// Hashers drawing their paths from one source, one per core, each with its
+// own reads in flight and a thread of its own taking its hashes.
+class HasherPool {
+ public:
+  typedef std::function<void(const ExifHasher::Entry& entry,
+                             std::ostream* os)> Handler;
+
+  HasherPool(PathSource* path_source, bool unique = true);
+
+  void Run(Handler handler, std::ostream* os);
+
+ private:
+  HasherPool(const HasherPool&);
+  HasherPool& operator=(const HasherPool&);
+
+  std::vector<std::unique_ptr<ExifHasher> > hashers_;
+};
+
+#endif // HASHER_POOL_HPP_
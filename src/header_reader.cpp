@@ -0,0 +1,300 @@
+#include "header_reader.hpp"
+
+#include "debug.hpp"
+#include "util/syscall.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+HeaderReader::File::File(const std::string& path)
+    : path(path),
+      length(0),
+      fd(-1),
+      error(0),
+      done(false) {}
+
+HeaderReader::HeaderReader(std::function<const char*(void)> path_gen,
+                           size_t depth, size_t size)
+    : path_gen_(path_gen),
+      depth_(depth),
+      size_(size),
+      more_(true),
+      ring_fd_(-1),
+      sq_ring_(MAP_FAILED),
+      cq_ring_(MAP_FAILED),
+      sqes_(MAP_FAILED),
+      to_submit_(0) {
+  if (!SetUpRing())
+    TearDownRing();
+  DEBUG_OUT_LN(HEADER, "ring_fd=%d; depth=%lu; size=%lu", ring_fd_, depth,
+               size);
+}
+
+HeaderReader::~HeaderReader() {
+  // wait for the reads in flight, which still write into the buffers
+  while (ring_fd_ != -1 &&
+         std::any_of(files_.begin(), files_.end(),
+                     [](const File& file) { return !file.done; })) {
+    Enter(1);
+    Reap();
+  }
+  TearDownRing();
+  for (const auto& file : files_) {
+    if (file.fd != -1)
+      close(file.fd);
+  }
+}
+
+// Returns the start of the next file in the order generated, or false once
+// all are returned.
+bool HeaderReader::Next(Header* header) {
+  Fill();
+  if (files_.empty())
+    return false;
+
+  File& file = files_.front();
+  if (ring_fd_ != -1) {
+    while (!file.done) {
+      Enter(1);
+      Reap();
+    }
+  } else {
+    Read(&file);
+  }
+  DEBUG_OUT_LN(HEADER, "fd=%2d; error=%d; size=%lu; path=%s | NEXT", file.fd,
+               file.error, file.bytes.size(), file.path.c_str());
+
+  file.bytes.resize(file.length);
+  header->path.swap(file.path);
+  header->bytes.swap(file.bytes);
+  header->error = file.error;
+  header->whole = !file.error && header->bytes.size() < size_;
+  if (file.fd != -1)
+    close(file.fd);
+  spare_buffers_.push_back(std::vector<unsigned char>());
+  spare_buffers_.back().swap(file.bytes); // the previous header's
+  files_.pop_front();
+  Fill();
+  return true;
+}
+
+// Generates paths until depth files are in flight, starting to read them.
+void HeaderReader::Fill() {
+  while (more_ && files_.size() < depth_) {
+    const char* path = path_gen_();
+    if (*path == '\0') {
+      more_ = false;
+      break;
+    }
+    files_.emplace_back(path);
+    File& file = files_.back();
+    if (!spare_buffers_.empty()) {
+      file.bytes.swap(spare_buffers_.back());
+      spare_buffers_.pop_back();
+    }
+    file.bytes.resize(size_);
+
+    if (ring_fd_ != -1) {
+      Submit(&file);
+      continue;
+    }
+
+    // start reading asynchronously; errors are harmless (only a hint)
+    if ((file.fd = open(file.path.c_str(), O_RDONLY)) != -1)
+      posix_fadvise(file.fd, 0, size_, POSIX_FADV_WILLNEED);
+    else
+      file.error = errno;
+  }
+  if (to_submit_)
+    Enter(0);
+}
+
+// Reads the start of the file synchronously (without io_uring).
+void HeaderReader::Read(File* file) {
+  while (!file->error && file->length < size_) {
+    ssize_t read_count = pread(file->fd, &file->bytes[file->length],
+                               size_ - file->length, file->length);
+    if (read_count == -1 && errno != EINTR)
+      file->error = errno;
+    if (read_count == 0)
+      break;
+    if (read_count > 0)
+      file->length += read_count;
+  }
+}
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+inline int io_uring_setup(unsigned entries, io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+inline int io_uring_enter(int ring_fd, unsigned to_submit,
+                          unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+inline int io_uring_register(int ring_fd, unsigned opcode, void* arg,
+                             unsigned nr_args) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Returns whether the ring can open and read files (Linux 5.6 and later).
+bool CanOpenAndRead(int ring_fd) {
+  const unsigned kOpCount = 256;
+  std::vector<char> buf(sizeof(io_uring_probe) +
+                        kOpCount * sizeof(io_uring_probe_op));
+  auto probe = reinterpret_cast<io_uring_probe*>(&buf[0]);
+  if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, kOpCount) == -1)
+    return false;
+  for (unsigned op : { IORING_OP_OPENAT, IORING_OP_READ }) {
+    if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+      return false;
+  }
+  return true;
+}
+
+} // namespace
+
+// Sets up the submission and completion rings, or returns false if io_uring
+// cannot be used here (old kernel, or denied by a seccomp filter).
+bool HeaderReader::SetUpRing() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if ((ring_fd_ = io_uring_setup(depth_, &params)) == -1 ||
+      !CanOpenAndRead(ring_fd_)) {
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED)
+    return false;
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED)
+      return false;
+  }
+  sqes_ = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED)
+    return false;
+
+  auto sq = static_cast<char*>(sq_ring_);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  auto cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+  return true;
+}
+
+void HeaderReader::TearDownRing() {
+  if (sqes_ != MAP_FAILED)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != MAP_FAILED)
+    munmap(sq_ring_, sq_ring_size_);
+  sq_ring_ = cq_ring_ = sqes_ = MAP_FAILED;
+  if (ring_fd_ != -1)
+    close(ring_fd_);
+  ring_fd_ = -1;
+}
+
+// Queues opening the file or, once it is open, reading on from its end.
+void HeaderReader::Submit(File* file) {
+  unsigned tail = *sq_tail_;
+  unsigned index = tail & *sq_mask_;
+  auto sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = reinterpret_cast<uintptr_t>(file);
+  if (file->fd == -1) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uintptr_t>(file->path.c_str());
+    sqe->open_flags = O_RDONLY;
+  } else {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&file->bytes[file->length]);
+    sqe->len = size_ - file->length;
+    sqe->off = file->length;
+  }
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++to_submit_;
+}
+
+// Submits the queued operations and waits for min_complete to complete.
+void HeaderReader::Enter(unsigned min_complete) {
+  int submitted;
+  while ((submitted = io_uring_enter(
+              ring_fd_, to_submit_, min_complete,
+              min_complete ? IORING_ENTER_GETEVENTS : 0)) == -1) {
+    if (errno != EINTR)
+      throw SysCallException(__FILE__, __LINE__, "io_uring_enter");
+  }
+  to_submit_ -= submitted;
+}
+
+// Handles the completed operations, queueing the reads of opened files.
+void HeaderReader::Reap() {
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const auto& cqe = static_cast<io_uring_cqe*>(cqes_)[head & *cq_mask_];
+    auto file = reinterpret_cast<File*>(cqe.user_data);
+    if (cqe.res < 0) {
+      file->error = -cqe.res;
+      file->done = true;
+    } else if (file->fd == -1) {
+      file->fd = cqe.res;
+      Submit(file);
+    } else {
+      // read on after a short read, until the end of the file
+      file->length += cqe.res;
+      file->done = (cqe.res == 0 || file->length == size_);
+      if (!file->done)
+        Submit(file);
+    }
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+bool HeaderReader::SetUpRing() { return false; }
+void HeaderReader::TearDownRing() {}
+void HeaderReader::Submit(File* file) {}
+void HeaderReader::Enter(unsigned min_complete) {}
+void HeaderReader::Reap() {}
+
+#endif // HAVE_IO_URING
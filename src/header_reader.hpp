@@ -0,0 +1,76 @@
+#ifndef HEADER_READER_HPP_
+#define HEADER_READER_HPP_
+
+#include <cstddef>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Reads the start of the files named by a generator, keeping up to depth of
+// them in flight at once through io_uring, so that the latency of opening and
+// reading them (on NFS or spinning disks) overlaps instead of adding up.
+// Where io_uring is unavailable, the files are opened ahead and the kernel
+// advised to read them in, as by Prefetcher.
+class HeaderReader {
+ public:
+  struct Header {
+    std::string path;
+    std::vector<unsigned char> bytes;
+    bool whole; // bytes are the whole file
+    int error;  // errno if the file could not be read, else 0
+  };
+
+  HeaderReader(std::function<const char*(void)> path_gen, size_t depth,
+               size_t size);
+  ~HeaderReader();
+
+  bool Next(Header* header);
+
+ private:
+  struct File {
+    File(const std::string& path);
+
+    std::string path;
+    std::vector<unsigned char> bytes;
+    size_t length; // of the bytes read so far
+    int fd;
+    int error;
+    bool done;
+  };
+
+  bool SetUpRing();
+  void TearDownRing();
+  void Fill();
+  void Submit(File* file);
+  void Enter(unsigned min_complete);
+  void Reap();
+  void Read(File* file);
+
+  std::function<const char*(void)> path_gen_;
+  size_t depth_;
+  size_t size_;
+  bool more_;
+  std::deque<File> files_;
+  std::vector<std::vector<unsigned char> > spare_buffers_;
+
+  // the io_uring, if available (ring_fd_ == -1 otherwise)
+  int ring_fd_;
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  void* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  void* cqes_;
+  unsigned to_submit_;
+};
+
+#endif // HEADER_READER_HPP_
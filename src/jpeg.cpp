@@ -0,0 +1,122 @@
+#include "jpeg.hpp"
+
+#include "exif_hash.hpp"
+
+#include <cstring>
+
+namespace {
+
+const unsigned char kMarker = 0xFF;
+const unsigned char kSOI = 0xD8;
+const unsigned char kSOS = 0xDA;
+const unsigned char kAPP0 = 0xE0;
+const unsigned char kAPP1 = 0xE1;
+const unsigned char kAPP15 = 0xEF;
+const unsigned char kCOM = 0xFE;
+
+const char kExifId[] = "Exif\0"; // followed by another 0 (the terminator)
+const size_t kExifIdLen = sizeof(kExifId);
+
+// prefix of the content hashed to identify an image without EXIF, which no
+// hashed EXIF (starting with a key like "Exif.Image.Make") can have
+const char kContentTag[] = "jpgsync:content";
+
+inline bool IsMetadata(unsigned char marker) {
+  return (marker >= kAPP0 && marker <= kAPP15) || marker == kCOM;
+}
+
+// Calls f(marker, begin, end) for every segment up to the start of scan, and
+// returns the offset of the scan (or 0 if the image is malformed).
+template<class Function>
+size_t ForEachSegment(const unsigned char* bytes, size_t size, Function f) {
+  if (size < 4 || bytes[0] != kMarker || bytes[1] != kSOI)
+    return 0;
+
+  size_t pos = 2;
+  while (pos + 4 <= size && bytes[pos] == kMarker) {
+    unsigned char marker = bytes[pos + 1];
+    if (marker == kMarker) { // fill byte
+      ++pos;
+      continue;
+    }
+    if (marker == kSOS)
+      return pos;
+
+    size_t len = (bytes[pos + 2] << 8) | bytes[pos + 3];
+    if (len < 2 || pos + 2 + len > size)
+      break;
+    f(marker, pos, pos + 2 + len);
+    pos += 2 + len;
+  }
+  return 0;
+}
+
+} // namespace
+
+// Returns the offset of the start of scan, which all the metadata segments
+// precede, or 0 if it is not within the bytes.
+size_t FindScan(const unsigned char* bytes, size_t size) {
+  return ForEachSegment(bytes, size, [](unsigned char, size_t, size_t) {});
+}
+
+// Finds the APP1 segment holding the EXIF data, including its marker.
+bool FindExifSegment(const unsigned char* bytes, size_t size,
+                     size_t* begin, size_t* end) {
+  bool found = false;
+  ForEachSegment(bytes, size, [&](unsigned char marker, size_t b, size_t e) {
+      if (!found && marker == kAPP1 && e - b >= 4 + kExifIdLen &&
+          !memcmp(bytes + b + 4, kExifId, kExifIdLen)) {
+        *begin = b;
+        *end = e;
+        found = true;
+      }
+    });
+  return found;
+}
+
+// Hashes everything but the metadata (APPn and COM) segments, i.e. what
+// stays the same when only tags are edited.
+bool HashImageData(const unsigned char* bytes, size_t size,
+                   unsigned char* digest) {
+  ExifHash::DigestType::Context ctx;
+  size_t scan = ForEachSegment(bytes, size, [&](unsigned char marker,
+                                                size_t b, size_t e) {
+      if (!IsMetadata(marker))
+        ctx.Update(bytes + b, e - b);
+    });
+  if (scan) {
+    ctx.Update(bytes + scan, size - scan);
+    ctx.Final(digest);
+  }
+  return scan;
+}
+
+// Hashes the whole file, tagged so as to never equal the hash of some EXIF.
+void HashContent(const unsigned char* bytes, size_t size,
+                 unsigned char* digest) {
+  ExifHash::DigestType::Context ctx;
+  ctx.Update(kContentTag, sizeof(kContentTag));
+  ctx.Update(bytes, size);
+  ctx.Final(digest);
+}
+
+// Replaces the EXIF segment of the image by the given one (or inserts it
+// right after the start of image, if there is none).
+bool SpliceExifSegment(const std::vector<char>& image,
+                       const std::vector<char>& segment,
+                       std::vector<char>* spliced) {
+  auto bytes = reinterpret_cast<const unsigned char*>(image.data());
+  size_t begin, end;
+  if (!FindExifSegment(bytes, image.size(), &begin, &end)) {
+    if (image.size() < 2 || bytes[0] != kMarker || bytes[1] != kSOI)
+      return false;
+    begin = end = 2;
+  }
+
+  spliced->clear();
+  spliced->reserve(image.size() - (end - begin) + segment.size());
+  spliced->insert(spliced->end(), image.begin(), image.begin() + begin);
+  spliced->insert(spliced->end(), segment.begin(), segment.end());
+  spliced->insert(spliced->end(), image.begin() + end, image.end());
+  return true;
+}
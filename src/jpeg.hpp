@@ -0,0 +1,19 @@
+#ifndef JPEG_HPP_
+#define JPEG_HPP_
+
+#include <cstddef>
+
+#include <vector>
+
+size_t FindScan(const unsigned char* bytes, size_t size);
+bool FindExifSegment(const unsigned char* bytes, size_t size,
+                     size_t* begin, size_t* end);
+bool HashImageData(const unsigned char* bytes, size_t size,
+                   unsigned char* digest);
+void HashContent(const unsigned char* bytes, size_t size,
+                 unsigned char* digest);
+bool SpliceExifSegment(const std::vector<char>& image,
+                       const std::vector<char>& segment,
+                       std::vector<char>* spliced);
+
+#endif // JPEG_HPP_
@@ -0,0 +1,93 @@
+#include "hasher_pool.hpp"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+const size_t kShardCount = 64;
+
+// The images found so far by their hash, split into shards locked on their
+// own, which tells which images are duplicates as soon as they are found.
+class Duplicates {
+ public:
+  // Adds the image, printing it if it is a duplicate (and the one it
+  // duplicates, if that is the first time).
+  void Add(const ExifHasher::Entry& entry, std::ostream* os) {
+    auto& shard = shards_[std::hash<ExifHash>()(entry.hash) % kShardCount];
+    std::lock_guard<std::mutex> locker(shard.mutex);
+    auto it = shard.groups.find(entry.hash);
+    if (it == shard.groups.end()) {
+      shard.groups.insert(std::make_pair(entry.hash, Group(&entry.path)));
+      return;
+    }
+
+    // hard links to the same file are not duplicates
+    auto& group = it->second;
+    if (group.inodes.empty())
+      group.inodes.push_back(ToInode(*group.first));
+    auto inode = ToInode(entry.path);
+    if (std::find(group.inodes.begin(), group.inodes.end(), inode) !=
+        group.inodes.end()) {
+      return;
+    }
+    group.inodes.push_back(inode);
+    if (group.inodes.size() == 2)
+      *os << entry.hash << ' ' << ' ' << *group.first << '\n';
+    *os << entry.hash << ' ' << ' ' << entry.path << '\n';
+  }
+
+ private:
+  typedef std::pair<dev_t, ino_t> Inode;
+
+  struct Group {
+    explicit Group(const std::string* first) : first(first) {}
+
+    const std::string* first; // path, kept by the hasher
+    std::vector<Inode> inodes; // of the images, once there are two
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<ExifHash, Group> groups;
+  };
+
+  static Inode ToInode(const std::string& path) {
+    struct stat stat_buf;
+    if (stat(path.c_str(), &stat_buf) == -1)
+      return Inode(0, 0);
+    return Inode(stat_buf.st_dev, stat_buf.st_ino);
+  }
+
+  Shard shards_[kShardCount];
+};
+
+} // namespace
+
+// Prints the images under the roots that have the same EXIF as another one,
+// as "hash  path" lines like jpghash, each group starting as soon as found.
+int main(int argc, char* argv[]) {
+  using namespace std;
+
+  if (argc < 2) {
+    cerr << "Usage: jpgdup DIR|FILE..." << endl;
+    return 1;
+  }
+
+  PathSource path_source(argv + 1, argc - 1);
+  HasherPool hasher_pool(&path_source, false);
+  Duplicates duplicates;
+  hasher_pool.Run([&duplicates](const ExifHasher::Entry& e, ostream* os) {
+      duplicates.Add(e, os);
+    }, &cout);
+
+  return 0;
+}
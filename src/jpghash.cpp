@@ -1,20 +1,59 @@
 #include "exif_hasher.hpp"
+#include "manifest.hpp"
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstring>
 #include <iostream>
+#include <vector>
 
 int main(int argc, char* argv[]) {
   using namespace std;
 
-  ExifHasher exif_hasher;
+  // with --manifest FILE, write the hashes to a manifest file instead
+  const char* manifest_path = NULL;
   int arg_ind = 0;
+  if (argc > 2 && strcmp(argv[1], "--manifest") == 0) {
+    manifest_path = argv[2];
+    arg_ind = 2;
+  }
+
+  ExifHasher exif_hasher;
   exif_hasher.Run(1, [&] { return ++arg_ind < argc ? argv[arg_ind] : ""; },
                   false);
+  vector<ManifestFile::Entry> entries;
   while (true) {
     size_t count = 1;
     auto e = exif_hasher.Get(&count);
     if (!count)
       break;
-    cout << *e->hash << ' ' << ' ' << e->path << endl;
+    if (manifest_path == NULL) {
+      cout << e->hash << ' ' << ' ' << e->path << endl;
+      continue;
+    }
+
+    // paths are kept relative to where the manifest is used, not ./
+    struct stat stat_buf;
+    if (stat(e->path.c_str(), &stat_buf) == -1)
+      continue;
+    ManifestFile::Entry entry;
+    entry.hash = e->hash;
+    entry.path = e->path.compare(0, 2, "./") == 0 ? e->path.substr(2) :
+        e->path;
+    entry.size = stat_buf.st_size;
+    entry.mtime = stat_buf.st_mtim.tv_sec * 1000000000LL +
+        stat_buf.st_mtim.tv_nsec;
+    entries.push_back(entry);
+  }
+
+  if (manifest_path != NULL) {
+    try {
+      ManifestFile::Write(manifest_path, &entries, true);
+    } catch (const std::exception& e) {
+      cerr << "Error: " << e.what() << endl;
+      return 1;
+    }
   }
 
   return 0;
@@ -1,34 +1,42 @@
-#include "exif_hasher.hpp"
-#include "util/string_utils.hpp"
+#include "hasher_pool.hpp"
+#include "sharded_store.hpp"
 #include "util/syscall.hpp"
 
 #include <iostream>
 
-#include <cerrno>
-#include <unistd.h>
-
+// Hard links the images under the roots into the working directory as a
+// store of ab/cd/<exif hash>.jpg (that jpgsync --sharded syncs), keeping
+// their names beside. Images linked before are left as they are.
 int main(int argc, char* argv[]) {
   using namespace std;
 
-  ExifHasher exif_hasher;
-  int arg_ind = 0;
-  exif_hasher.Run(1, [&] { return ++arg_ind < argc ? argv[arg_ind] : ""; });
-
-  while (true) {
-    size_t count = 1;
-    auto e = exif_hasher.Get(&count);
-    if (!count)
-      break;
-    cout << "ln " << e->path << ' ' << *e->hash << endl;
-    try {
-      sys_call(link, e->path.c_str(), ToString(*e->hash).c_str());
-    } catch (const SysCallException& ex) {
-      if (ex.code() == EEXIST) {
-        cerr << "Warning: link already exists " << e->path << endl;
-      } else
-        throw ex;
-    }
+  if (argc < 2) {
+    cerr << "Usage: jpgln DIR|FILE..." << endl;
+    return 1;
   }
 
+  ShardedStore store(".");
+  PathSource path_source(argv + 1, argc - 1);
+  HasherPool hasher_pool(&path_source);
+  hasher_pool.Run([&store](const ExifHasher::Entry& e, ostream* os) {
+      try {
+        switch (store.Link(e.hash, e.path)) {
+          case ShardedStore::kLinked:
+            store.AddName(e.hash, e.path.substr(e.path.rfind('/') + 1));
+            *os << "ln " << e.path << ' ' << ShardedStore::ToPath(e.hash)
+                << '\n';
+            break;
+          case ShardedStore::kAlreadyLinked:
+            break;
+          case ShardedStore::kConflict:
+            cerr << "Warning: another image is linked as " << e.hash << ' '
+                 << e.path << endl;
+            break;
+        }
+      } catch (const SysCallException& ex) {
+        cerr << "Warning: " << ex.what() << endl;
+      }
+    }, &cout);
+
   return 0;
 }
@@ -1,5 +1,12 @@
+#include "bundle.hpp"
+#include "library.hpp"
+#include "manifest.hpp"
 #include "master.hpp"
+#include "mesh.hpp"
+#include "protocol.hpp"
+#include "sharded_store.hpp"
 #include "slave.hpp"
+#include "watcher.hpp"
 #include "util/dir.hpp"
 #include "util/fd.hpp"
 #include "util/logger.hpp"
@@ -9,19 +16,44 @@
 
 #include <cctype>
 #include <cerrno>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #define PROG "jpgsync"
 #define CERR ::std::cerr << PROG ": "
 
+const int kMaxMeshSize = 255; // ranks are exchanged as bytes
+
+// where a daemon advertises its port (and pid) in its root, and how often it
+// rescans the root for new images
+const char* kPortFile = ".jpgsync.port";
+const int kRescanInterval = 60; // seconds
+
+// number of directory entries hashed in inode (roughly disk) order at a time
+const size_t kScanWindow = 8192;
+
+std::string gPortPath; // removed by the daemon when terminated
+int gStopPipe[2]; // written to on the signal to stop the daemon
+
 bool ExtractPort(const char* begin, const char* end, uint16_t* port) {
   int ret = 0;
   while (begin != end) {
@@ -32,6 +64,22 @@ bool ExtractPort(const char* begin, const char* end, uint16_t* port) {
   return true;
 }
 
+// Reads the port of the daemon serving the dir, if one is running.
+bool ReadDaemonPort(const std::string& dir, uint16_t* port) {
+  std::ifstream ifs(dir + '/' + kPortFile);
+  pid_t pid;
+  return (ifs >> *port >> pid) && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+std::vector<std::string> Split(const std::string& s, char sep) {
+  std::vector<std::string> tokens;
+  for (size_t pos = 0, end; ; pos = end + 1) {
+    tokens.push_back(s.substr(pos, (end = s.find(sep, pos)) - pos));
+    if (end == std::string::npos)
+      return tokens;
+  }
+}
+
 struct JpgsyncOptions : public ProgramOptions<> {
   class Root {
    public:
@@ -75,6 +123,45 @@ struct JpgsyncOptions : public ProgramOptions<> {
         local('l', "local", "run as local (NOTE: for internal use)", this),
         distribute('d', "distribute",
                    "(re-)distribute the program on remote hosts", this),
+        sharded('S', "sharded",
+                "store images as ab/cd/<exif hash>.jpg (with a name index)",
+                this),
+        exif_delta('e', "exif-delta",
+                   "send only the EXIF of images whose image data the "
+                   "receiver has", this),
+        content_hash('c', "content-hash", "identify images without EXIF by "
+                     "a hash of their whole content (instead of skipping "
+                     "them)", this),
+        sorted_update("sorted-update", "send the update as a sorted "
+                      "manifest, compared to the own one by a merge (instead "
+                      "of looking each image up)", this),
+        memory_budget("memory-budget", "keep the hashes and entries of the "
+                      "images within about MB megabytes, spilling them to "
+                      "files in the roots (only for a plain sync of two "
+                      "roots)", this),
+        manifest("manifest", "take the hashes of the images in a root "
+                 "from its manifest file NAME (see jpghash --manifest) where "
+                 "they are current, instead of hashing them", this),
+        diff("diff", "print the images only in manifest A (<) and only in "
+             "manifest B (>), without syncing", this),
+        bundle("bundle", "write the images of manifest A (in its directory) "
+               "that manifest B lacks to bundle FILE (e.g. /dev/stdout), "
+               "without syncing", this),
+        apply("apply", "write the images of bundle FILE (e.g. /dev/stdin) to "
+              "DIR", this),
+        serve("serve", "with -m, serve any number of slaves concurrently "
+              "(until killed)", this),
+        port('p', "port", "with -m, listen on PORT (default: any free one)",
+             this),
+        mesh("mesh", "with -m, run as member RANK/HOST1,HOST2,... of a mesh "
+             "(NOTE: for internal use)", this),
+        peers("peers", "with --mesh, connect to the members at "
+              "HOST:PORT,... (NOTE: for internal use)", this),
+        daemon('D', "daemon", "run as master serving slaves until killed, "
+               "keeping the index current (used by masters run on DIR)",
+               this),
+        watch('w', "watch", "keep syncing the images completed in the roots "
+              "until interrupted", this),
         nc_test("nc-test", "test launcher/interface with netcat (nc)", this) {}
 
   void PrintUsage(std::ostream& os) const {
@@ -84,31 +171,134 @@ struct JpgsyncOptions : public ProgramOptions<> {
         options << std::endl <<
         "  or   " PROG << " [[USER@]HOST:]DIR -m" <<
         options << std::endl <<
+        "  or   " PROG << " [[USER@]HOST:]DIR -D" <<
+        options << std::endl <<
         "  or   " PROG << " [[USER@]HOST:]DIR -s MASTER" <<
         options << std::endl <<
+        "  or   " PROG << " [[USER1@]HOST1:]DIR1 ... [[USERN@]HOSTN:]DIRN" <<
+        options << std::endl <<
+        "  or   " PROG << " A.jm B.jm --diff|--bundle FILE" <<
+        options << std::endl <<
+        "  or   " PROG << " DIR --apply FILE" <<
+        options << std::endl <<
         std::endl;
     ProgramOptions<>::PrintUsage(os);
   }
 
   const std::string& master_host() const { return master_host_; }
   uint16_t master_port() const { return master_port_; }
+  uint16_t listen_port() const { return listen_port_; }
   const Root& master_root() const { return master_root_; }
   const Root& slave_root() const { return slave_root_; }
+  const std::vector<Root>& mesh_roots() const { return mesh_roots_; }
+  size_t mesh_rank() const { return mesh_rank_; }
+  size_t memory_budget_bytes() const { return memory_budget_; }
+  const std::vector<std::string>& mesh_hosts() const { return mesh_hosts_; }
+  const std::vector<std::pair<std::string, uint16_t> >& mesh_peers() const {
+    return mesh_peers_;
+  }
 
   Option<> master;
   Option<std::string> slave;
   Option<> local;
   Option<> distribute;
+  Option<> sharded;
+  Option<> exif_delta;
+  Option<> content_hash;
+  Option<> sorted_update;
+  Option<std::string> memory_budget;
+  Option<std::string> manifest;
+  Option<> diff;
+  Option<std::string> bundle;
+  Option<std::string> apply;
+  Option<> serve;
+  Option<std::string> port;
+  Option<std::string> mesh;
+  Option<std::string> peers;
+  Option<> daemon;
+  Option<> watch;
   Option<> nc_test;
 
  protected:
   void InitDefaults(int argc, char** argv) {
     using namespace std;
 
+    // a daemon is a master
+    if (daemon.count())
+      SetIfNot(true, &master);
+
+    // the offline modes take manifests (or a bundle) instead of roots
+    if (diff.count() + bundle.count() + apply.count() > 1)
+      throw Exception("Options --diff, --bundle and --apply are exclusive.");
+    if (diff.count() || bundle.count() || apply.count()) {
+      if (argc - 1 != (apply.count() ? 1 : 2))
+        throw Exception(apply.count() ? "Invalid number of dirs (need 1)" :
+                        "Invalid number of manifests (need 2)");
+      return;
+    }
+
     // check not both -m and -s are specified, unless -l is also specified
     if (slave.count() && master.count())
       throw Exception("Options -m and -s are mutually exclusive.");
 
+    // check the options of a master are not given otherwise
+    if ((serve.count() || port.count() || mesh.count()) && !master.count())
+      throw Exception("Options --serve, -p and --mesh require -m (or -D).");
+    listen_port_ = 0;
+    if (port.count() &&
+        !ExtractPort(&*port().begin(), &*port().end(), &listen_port_))
+      throw Exception("Invalid port: " + port());
+
+    // with memory bounded, a library keeps nothing for other sessions or
+    // later images, nor the image data hashes (looked up in memory)
+    memory_budget_ = 0;
+    if (memory_budget.count()) {
+      size_t megabytes;
+      if (!(istringstream(memory_budget()) >> megabytes) || !megabytes)
+        throw Exception("Invalid memory budget: " + memory_budget());
+      memory_budget_ = megabytes << 20;
+      if (serve.count() || daemon.count() || mesh.count() || watch.count() ||
+          exif_delta.count() ||
+          (!slave.count() && !master.count() && argc - 1 > 2)) {
+        throw Exception("Option --memory-budget is only for a plain sync of "
+                        "two roots (without --serve, -D, -w or -e).");
+      }
+    }
+
+    // parse the place in the mesh and the members to connect to
+    if (mesh.count()) {
+      size_t pos = mesh().find('/');
+      mesh_hosts_ = Split(mesh().substr(pos + 1), ',');
+      if (pos == string::npos ||
+          !(istringstream(mesh().substr(0, pos)) >> mesh_rank_) ||
+          mesh_rank_ >= mesh_hosts_.size()) {
+        throw Exception("Invalid mesh: " + mesh());
+      }
+    }
+    if (peers.count()) {
+      for (const auto& peer : Split(peers(), ',')) {
+        size_t pos = peer.rfind(':');
+        mesh_peers_.push_back(make_pair(peer.substr(0, pos), 0));
+        if (pos == string::npos || !ExtractPort(&*peer.begin() + pos + 1,
+                                                &*peer.end(),
+                                                &mesh_peers_.back().second))
+          throw Exception("Invalid mesh peer: " + peer);
+      }
+    }
+
+    // sync more than two dirs in a mesh, all with each other at once
+    if (!slave.count() && !master.count() && argc - 1 > 2) {
+      if (argc - 1 > kMaxMeshSize)
+        throw Exception("Too many roots (max " + ToString(kMaxMeshSize) + ")");
+      mesh_roots_.resize(argc - 1);
+      for (int i = 1; i < argc; ++i) {
+        mesh_roots_[i - 1].Init(argv[i]);
+        if (verbosity())
+          cerr << "Mesh root " << i - 1 << ": " << mesh_roots_[i - 1];
+      }
+      return;
+    }
+
     // check the right number of dirs is specified by argv
     if ((slave.count() || master.count()) + (argc - 1) != 2)
       throw Exception("Invalid number of roots (need " +
@@ -123,7 +313,10 @@ struct JpgsyncOptions : public ProgramOptions<> {
         cerr << "Master root: " << master_root_;
     }
     if (!master.count()) {
-      if (slave_root_.Init(argv[++root_ind]) &&/*root_ind&&*/ !master_remote) {
+      // (or such that a local root kept by a daemon is the master)
+      uint16_t daemon_port;
+      if (slave_root_.Init(argv[++root_ind]) ? !master_remote :
+          !master_remote && ReadDaemonPort(slave_root_.dir, &daemon_port)) {
         swap(master_root_, slave_root_);
         swap(argv[root_ind - 1], argv[root_ind]);
       }
@@ -149,8 +342,14 @@ struct JpgsyncOptions : public ProgramOptions<> {
  private:
   std::string master_host_;
   uint16_t master_port_;
+  uint16_t listen_port_;
   Root master_root_;
   Root slave_root_;
+  std::vector<Root> mesh_roots_;
+  size_t mesh_rank_;
+  size_t memory_budget_;
+  std::vector<std::string> mesh_hosts_;
+  std::vector<std::pair<std::string, uint16_t> > mesh_peers_;
 } gPO;
 
 class Executor {
@@ -289,6 +488,239 @@ Executor* Executor::Create(const JpgsyncOptions::Root& root,
       static_cast<Executor*>(new RemoteExecutor(root));
 }
 
+// Adds the images completed in the root of the library to it while alive.
+class LibraryWatch {
+ public:
+  LibraryWatch(Library* library)
+      : watcher_(library->dir()),
+        thread_([this, library] {
+            watcher_.Run([library](const std::vector<std::string>& paths) {
+                library->Add(paths);
+              });
+          }) {}
+  ~LibraryWatch() {
+    watcher_.Stop();
+    thread_.join();
+  }
+
+ private:
+  Watcher watcher_;
+  std::thread thread_;
+};
+
+// Starts scanning the root of the library (after starting to watch it, if
+// asked to, so that no image is missed in between).
+LibraryWatch* Scan(Library* library, Peer::PathGenerator path_gen) {
+  if (gPO.manifest.count() && !library->UseManifest(gPO.manifest())) {
+    throw SyncError("no manifest " + gPO.manifest() + " in " +
+                    library->dir());
+  }
+  auto watch = gPO.watch.count() ? new LibraryWatch(library) : NULL;
+  library->Scan(UpdateProtocol::hashes_per_packet, path_gen,
+                gPO.exif_delta.count(), gPO.content_hash.count());
+  return watch;
+}
+
+// Syncs the root with all other members of the mesh at once, serving the
+// higher ranked ones and connecting to the lower ranked ones.
+void SyncMesh(Master* master, Peer::PathGenerator path_gen,
+              const std::string& root, Logger* logger) {
+  Mesh mesh(gPO.mesh_rank(), gPO.mesh_hosts());
+  Library library(root, gPO.sharded.count());
+  std::unique_ptr<LibraryWatch> watch(Scan(&library, path_gen));
+
+  std::vector<std::thread> threads;
+  for (const auto& member : gPO.mesh_peers()) {
+    threads.push_back(std::thread([&, member] {
+          auto member_str = member.first + ":" + ToString(member.second);
+          Slave slave(logger);
+          slave.set_sharded(gPO.sharded.count());
+          slave.set_exif_delta(gPO.exif_delta.count());
+          slave.set_content_hash(gPO.content_hash.count());
+          slave.set_sorted_update(gPO.sorted_update.count());
+          slave.set_watch(gPO.watch.count());
+          slave.set_mesh(&mesh);
+          try {
+            slave.Attach(member.first, member.second);
+          } catch (const std::exception& e) {
+            mesh.Abandon();
+            logger->Error("mesh member " + member_str + " failed: " + e.what());
+            return;
+          }
+          try {
+            slave.Sync(&library);
+          } catch (const std::exception& e) {
+            logger->Error("mesh member " + member_str + " failed: " + e.what());
+          }
+        }));
+  }
+
+  master->set_mesh(&mesh);
+  if (mesh.rank() + 1 < mesh.size())
+    master->Serve(&library, mesh.size() - 1 - mesh.rank());
+  for (auto& thr : threads)
+    thr.join();
+}
+
+// Returns a generator of the paths of the files in the root directory (or its
+// shards), skipping the files of jpgsync itself.
+Peer::PathGenerator MakePathGenerator(const std::string& root) {
+  auto dir = std::make_shared<Dir>(root, gPO.sharded.count(),
+                                   kScanWindow);
+  auto names_path = root + '/' + ShardedStore::kNamesFile;
+  auto port_path = root + '/' + kPortFile;
+  auto manifest_path = gPO.manifest.count() ? root + '/' + gPO.manifest() :
+      names_path;
+  return [=] {
+    const std::string* path;
+    while (*(path = &dir->Next()) == names_path || *path == port_path ||
+           *path == manifest_path)
+      ;
+    return path->c_str();
+  };
+}
+
+// Rescans the root of the library every kRescanInterval seconds while alive.
+class LibraryRescan {
+ public:
+  LibraryRescan(Library* library, const std::string& root, Logger* logger)
+      : stopping_(false),
+        thread_([this, library, root, logger] {
+            std::unique_lock<std::mutex> locker(mutex_);
+            while (!stopped_.wait_for(locker,
+                                      std::chrono::seconds(kRescanInterval),
+                                      [this] { return stopping_; })) {
+              locker.unlock();
+              size_t gone_count = library->Rescan(MakePathGenerator(root));
+              if (gone_count) {
+                logger->Verbose("dropped " + ToString(gone_count) +
+                                " images gone from " + root);
+              }
+              locker.lock();
+            }
+          }) {}
+  ~LibraryRescan() {
+    {
+      std::lock_guard<std::mutex> locker(mutex_);
+      stopping_ = true;
+    }
+    stopped_.notify_one();
+    thread_.join();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+// Tells the daemon to stop, leaving that to its main thread (as a signal
+// handler can hardly do anything itself).
+void NotifyStop(int /*sig*/) {
+  char byte = 0;
+  ssize_t write_count = write(gStopPipe[1], &byte, sizeof(byte));
+  (void)write_count; // a notification is pending already
+}
+
+// Serves slaves until killed, advertising the port in the root (for masters
+// run on it to hand over to) and rescanning the root for new images (unless
+// watching it).
+void RunDaemon(Master* master, uint16_t port, const std::string& root,
+               Logger* logger) {
+  Library library(root, gPO.sharded.count());
+  std::unique_ptr<LibraryWatch> watch(Scan(&library,
+                                           MakePathGenerator(root)));
+
+  gPortPath = root + '/' + kPortFile;
+  auto tmp_path = gPortPath + ".tmp";
+  {
+    std::ofstream ofs(tmp_path);
+    ofs << port << ' ' << getpid() << std::endl;
+    if (!ofs)
+      throw SyncError("failed to write " + tmp_path);
+  }
+  sys_call(rename, tmp_path.c_str(), gPortPath.c_str());
+  sys_call(pipe2, gStopPipe, O_NONBLOCK);
+  signal(SIGINT, NotifyStop);
+  signal(SIGTERM, NotifyStop);
+
+  // serve on a thread of its own, so that this one can wait to be stopped
+  std::unique_ptr<LibraryRescan> rescan(
+      watch == NULL ? new LibraryRescan(&library, root, logger) : NULL);
+  std::exception_ptr serve_error;
+  std::thread serve_thread([&] {
+      try {
+        master->Serve(&library, 0);
+      } catch (...) {
+        serve_error = std::current_exception();
+      }
+      NotifyStop(0);
+    });
+  pollfd stop_pollfd = { gStopPipe[0], POLLIN, 0 };
+  while (poll(&stop_pollfd, 1, -1) == -1 && errno == EINTR)
+    ;
+  unlink(gPortPath.c_str());
+
+  if (serve_error) {
+    serve_thread.join();
+    std::rethrow_exception(serve_error);
+  }
+  // the sessions still running are cut off, but what they logged is not
+  logger->Verbose("stopped serving " + root);
+  logger->Flush();
+  _exit(0);
+}
+
+// Compares two manifests, or bundles or applies the images missing on one
+// side, without any network.
+int RunOffline(char** argv) {
+  Logger logger(PROG, gPO.verbosity());
+  try {
+    if (gPO.apply.count()) {
+      int fd;
+      sys_call_rv(fd, open, gPO.apply().c_str(), O_RDONLY);
+      FD bundle_fd = fd;
+      size_t count = ApplyBundle(bundle_fd, argv[1], &logger);
+      logger.Verbose("applied " + ToString(count) + " images");
+      return logger.exit_status();
+    }
+
+    ManifestFile a(argv[1]), b(argv[2]);
+    std::vector<size_t> a_only, b_only;
+    DiffManifests(a, b, &a_only, &b_only);
+    if (gPO.diff.count()) {
+      for (auto i : a_only)
+        std::cout << "< " << a.hash(i) << "  " << a.path(i) << '\n';
+      for (auto j : b_only)
+        std::cout << "> " << b.hash(j) << "  " << b.path(j) << '\n';
+      std::cout.flush();
+      logger.Verbose(ToString(a_only.size()) + " images only in " + argv[1] +
+                     ", " + ToString(b_only.size()) + " only in " + argv[2]);
+      return logger.exit_status();
+    }
+
+    // bundle one copy of each image B lacks
+    a_only.erase(std::unique(a_only.begin(), a_only.end(),
+                             [&](size_t lhs, size_t rhs) {
+                               return a.hash(lhs) == a.hash(rhs);
+                             }),
+                 a_only.end());
+    std::string root(argv[1]);
+    size_t pos = root.rfind('/');
+    root = pos == std::string::npos ? "." : root.substr(0, pos);
+    int fd;
+    sys_call_rv(fd, open, gPO.bundle().c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                0666);
+    FD bundle_fd = fd;
+    size_t count = WriteBundle(bundle_fd, root, a, a_only, &logger);
+    logger.Verbose("bundled " + ToString(count) + " images");
+  } catch (const std::exception& e) {
+    logger.Error(e.what());
+  }
+  return logger.exit_status();
+}
+
 int main(int argc, char** argv) {
   using namespace std;
 
@@ -305,6 +737,9 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  if (gPO.diff.count() || gPO.bundle.count() || gPO.apply.count())
+    return RunOffline(argv);
+
   int exit_status = 0;
 
   if (!gPO.local.count()) {
@@ -312,6 +747,55 @@ int main(int argc, char** argv) {
     std::string local_arg = "--" + gPO.local.name();
     args.push_back(local_arg.c_str());
 
+    if (!gPO.mesh_roots().empty()) {
+      // run a mesh member for each root (as a master that also connects to
+      // the members run before it), capturing the port of each
+      const auto& roots = gPO.mesh_roots();
+      std::string mesh_hosts;
+      for (size_t rank = 0; rank < roots.size(); ++rank)
+        mesh_hosts += (rank ? "," : "") + roots[rank].hostname;
+      args.push_back("-m");
+      args.push_back("--mesh");
+      args.push_back(NULL);
+      size_t mesh_arg_ind = args.size() - 1;
+
+      std::string mesh_arg, peers, peers_arg;
+      vector<pair<Executor*, FILE*> > members;
+      for (size_t rank = 0; rank < roots.size(); ++rank) {
+        if (gPO.verbosity())
+          cerr << "Running mesh member " << rank << " ..." << endl;
+        args[roots.size()] = roots[rank].dir.c_str();
+        args[mesh_arg_ind] = (mesh_arg = ToString(rank) + "/" +
+                              mesh_hosts).c_str();
+        if (rank) {
+          args.push_back("--peers");
+          args.push_back((peers_arg = peers).c_str());
+        }
+        auto executor = Executor::Create(roots[rank], argv[0]);
+        std::string port;
+        members.push_back(make_pair(executor, executor->Execute(
+            &*args.begin() + roots.size(), &*args.end(), &port)));
+        if (rank) {
+          args.pop_back();
+          args.pop_back();
+          peers += ',';
+        }
+        peers += (roots[rank].hostname.empty() ?
+                  string("localhost") : roots[rank].hostname) + ":" + port;
+      }
+
+      // await termination of all of them
+      for (auto& member : members) {
+        member.first->Wait(member.second, &exit_status);
+        delete member.first;
+      }
+      if (exit_status)
+        CERR << "sync failed" << endl;
+      else if (gPO.verbosity())
+        cerr << "sync succeeded" << endl;
+      return exit_status;
+    }
+
     Executor* master;
     Executor* slave;
     if (!gPO.slave.count()) {
@@ -388,32 +872,67 @@ int main(int argc, char** argv) {
     return exit_status;
   }
 
+  // the sessions log from several threads each, which should not wait on
+  // each other (nor on the terminal)
   Logger logger(PROG, gPO.verbosity());
+  logger.WriteInBackground();
   const auto& root = (gPO.master.count() ?
                       gPO.master_root().dir :
                       gPO.slave_root().dir);
 
+  // leave a plain sync to the daemon keeping the root, if one is running
+  uint16_t daemon_port;
+  if (gPO.master.count() && !gPO.daemon.count() && !gPO.serve.count() &&
+      !gPO.mesh.count() && ReadDaemonPort(root, &daemon_port)) {
+    logger.Verbose("handing over to the daemon keeping " + root);
+    cout << "Listening on port " << daemon_port << endl;
+    return 0;
+  }
+
   Peer* peer = NULL;
   try {
-    // create a path generator for files in the root directory
-    Dir dir(root);
-    auto path_gen = [&] { return dir.Next().c_str(); };
+    auto path_gen = MakePathGenerator(root);
 
     // create the corresponding peer (master / slave)
+    Master* master = NULL;
+    uint16_t listen_port = 0;
     if (gPO.master.count()) {
-      auto master = new Master(&logger);
-      cout << "Listening on port " << master->Listen() << endl;
+      master = new Master(&logger);
+      master->set_port(gPO.listen_port());
+      cout << "Listening on port " << (listen_port = master->Listen()) << endl;
       peer = master;
     } else {
       auto slave = new Slave(&logger);
       slave->Attach(gPO.master_host(), gPO.master_port());
       peer = slave;
     }
-
-    // synchronize images
-    peer->Sync(path_gen, root);
+    peer->set_sharded(gPO.sharded.count());
+    peer->set_exif_delta(gPO.exif_delta.count());
+    peer->set_content_hash(gPO.content_hash.count());
+    peer->set_sorted_update(gPO.sorted_update.count());
+    peer->set_memory_budget(gPO.memory_budget_bytes());
+    peer->set_watch(gPO.watch.count());
+
+    // synchronize images (with any number of slaves if serving)
+    if (master != NULL && gPO.mesh.count()) {
+      SyncMesh(master, path_gen, root, &logger);
+    } else if (master != NULL && gPO.daemon.count()) {
+      RunDaemon(master, listen_port, root, &logger);
+    } else {
+      Library library(root, gPO.sharded.count());
+      library.set_bounded(gPO.memory_budget_bytes() != 0);
+      std::unique_ptr<LibraryWatch> watch(Scan(&library, path_gen));
+      if (master != NULL && gPO.serve.count())
+        master->Serve(&library, 0);
+      else
+        peer->Sync(&library);
+    }
+  } catch (const SyncError& e) {
+    logger.Fatal(e.what());
   } catch (const SysCallException& e) {
     logger.Fatal(e.what());
+  } catch (const std::exception& e) {
+    logger.Fatal(e.what()); // e.g. an invalid manifest
   }
   delete peer;
 
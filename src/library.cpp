@@ -0,0 +1,154 @@
+#include "library.hpp"
+
+#include "util/syscall.hpp"
+
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+Library::Library(const std::string& dir, bool sharded)
+    : dir_(dir),
+      name_index_(dir),
+      store_(sharded ? new ShardedStore(dir) : NULL),
+      bounded_(false) {}
+
+// Starts hashing the images, indexing the names in dir as they are scanned.
+void Library::Scan(size_t progress_threshold,
+                   std::function<const char*(void)> path_gen,
+                   bool image_hashing, bool content_hashing) {
+  exif_hasher_.set_image_hashing(image_hashing);
+  exif_hasher_.set_content_hashing(content_hashing);
+  exif_hasher_.Run(progress_threshold, [this, path_gen] {
+      const char* path;
+      while (*(path = path_gen()) && !AddPath(path))
+        ; // received (and added) while scanning
+      return path;
+    });
+}
+
+// Hashes the images that appeared since the last scan (once that is done),
+// and drops those that are gone, returning their number.
+size_t Library::Rescan(std::function<const char*(void)> path_gen) {
+  exif_hasher_.Wait();
+  std::unordered_set<std::string> seen;
+  for (const char* path; *(path = path_gen()); ) {
+    if (!bounded_)
+      seen.insert(path);
+    if (!AddPath(path))
+      continue;
+    try {
+      exif_hasher_.Add(path);
+    } catch (const SysCallException& e) {
+      // removed again already
+    }
+  }
+  if (bounded_)
+    return 0;
+
+  // (an image received while scanning may not have been seen, but is there)
+  std::unordered_set<std::string> gone;
+  {
+    std::lock_guard<decltype(mutex_)> locker(mutex_);
+    for (const auto& path : paths_) {
+      if (!seen.count(path) && access(path.c_str(), F_OK) == -1)
+        gone.insert(path);
+    }
+    for (const auto& path : gone)
+      paths_.erase(path);
+  }
+  for (const auto& path : gone)
+    name_index_.RemovePath(path);
+  return gone.empty() ? 0 : exif_hasher_.Remove(gone);
+}
+
+// Takes the hashes of the images from the manifest of that name in dir (with
+// the paths relative to dir) instead of hashing them, where their sizes and
+// times still match. Returns false if there is no such manifest.
+bool Library::UseManifest(const std::string& name) {
+  auto path = dir_ + '/' + name;
+  if (access(path.c_str(), F_OK) == -1)
+    return false;
+  manifest_.reset(new ManifestFile(path));
+  auto prefix = dir_ + '/';
+  exif_hasher_.set_hash_lookup([this, prefix](const char* path,
+                                              ExifHash* hash) {
+      if (strncmp(path, prefix.c_str(), prefix.size()) != 0)
+        return false;
+      size_t ind = manifest_->FindPath(path + prefix.size());
+      if (ind == ManifestFile::npos)
+        return false;
+      struct stat stat_buf;
+      if (manifest_->has_stat() &&
+          (stat(path, &stat_buf) == -1 ||
+           manifest_->file_size(ind) != uint64_t(stat_buf.st_size) ||
+           manifest_->mtime(ind) != stat_buf.st_mtim.tv_sec * 1000000000LL +
+                                    stat_buf.st_mtim.tv_nsec)) {
+        return false;
+      }
+      *hash = manifest_->hash(ind);
+      return true;
+    });
+  return true;
+}
+
+// Adds a received image, stored in dir under the given name (unless storing
+// it failed).
+void Library::Add(const ExifHash& hash, const std::string& name) {
+  std::string path = dir_ + '/' + name;
+  struct stat stat_buf;
+  if (stat(path.c_str(), &stat_buf) == -1)
+    return;
+  AddPath(path);
+  exif_hasher_.Add(hash, path);
+}
+
+// Hashes the files (e.g. completed in dir since the scan), unless known.
+void Library::Add(const std::vector<std::string>& paths) {
+  for (const auto& path : paths) {
+    if (!AddPath(path))
+      continue;
+    try {
+      exif_hasher_.Add(path);
+    } catch (const SysCallException& e) {
+      // removed again already (e.g. a temporary file)
+    }
+  }
+}
+
+// Marks the image as being received, unless a session already claimed it.
+bool Library::Claim(const ExifHash& hash) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  return claimed_.insert(hash).second;
+}
+
+// Lets another session receive the image again, once this one stored it (so
+// that it is found in the library instead) or failed to.
+void Library::Unclaim(const ExifHash& hash) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  claimed_.erase(hash);
+}
+
+// Keeps neither the paths scanned (so that each must be scanned once, without
+// watching) nor an index of the hashes (see ExifHasher::set_bounded), before
+// scanning.
+void Library::set_bounded(bool bounded) {
+  bounded_ = bounded;
+  exif_hasher_.set_bounded(bounded);
+}
+
+// Marks the path as scanned (and its name as taken), unless it already was.
+bool Library::AddPath(const std::string& path) {
+  if (!bounded_) {
+    std::lock_guard<decltype(mutex_)> locker(mutex_);
+    if (!paths_.insert(path).second)
+      return false;
+  }
+  name_index_.AddPath(path);
+  return true;
+}
+
+const std::string& Library::dir() const { return dir_; }
+ExifHasher& Library::exif_hasher() { return exif_hasher_; }
+NameIndex& Library::name_index() { return name_index_; }
+ShardedStore* Library::store() { return store_.get(); }
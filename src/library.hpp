@@ -0,0 +1,54 @@
+#ifndef LIBRARY_HPP_
+#define LIBRARY_HPP_
+
+#include "exif_hash.hpp"
+#include "exif_hasher.hpp"
+#include "manifest.hpp"
+#include "name_index.hpp"
+#include "sharded_store.hpp"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// The images in a directory, scanned once and shared by all sync sessions
+// that upload from and download into it (possibly at the same time).
+class Library {
+ public:
+  Library(const std::string& dir, bool sharded);
+
+  void Scan(size_t progress_threshold,
+            std::function<const char*(void)> path_gen, bool image_hashing,
+            bool content_hashing = false);
+  size_t Rescan(std::function<const char*(void)> path_gen);
+  bool UseManifest(const std::string& name);
+  void Add(const ExifHash& hash, const std::string& name);
+  void Add(const std::vector<std::string>& paths);
+  bool Claim(const ExifHash& hash);
+  void Unclaim(const ExifHash& hash);
+  void set_bounded(bool bounded);
+
+  const std::string& dir() const;
+  ExifHasher& exif_hasher();
+  NameIndex& name_index();
+  ShardedStore* store();
+
+ private:
+  bool AddPath(const std::string& path);
+
+  std::string dir_;
+  ExifHasher exif_hasher_;
+  NameIndex name_index_;
+  std::unique_ptr<ShardedStore> store_;
+  std::unique_ptr<ManifestFile> manifest_;
+
+  std::mutex mutex_;
+  bool bounded_; // not keeping the paths scanned
+  std::unordered_set<std::string> paths_;
+  std::unordered_set<ExifHash> claimed_;
+};
+
+#endif // LIBRARY_HPP_
@@ -0,0 +1,298 @@
+#include "manifest.hpp"
+
+#include "util/fd.hpp"
+#include "util/syscall.hpp"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+// Compares the hashes like memcmp, deciding by the leading 64 bits (one
+// compare) unless they are equal, which is rare for distinct hashes.
+inline int Compare(const ExifHash& lhs, const ExifHash& rhs) {
+  uint64_t lhs_prefix = lhs.prefix(), rhs_prefix = rhs.prefix();
+  if (lhs_prefix != rhs_prefix)
+    return lhs_prefix < rhs_prefix ? -1 : 1;
+  return lhs < rhs ? -1 : rhs < lhs;
+}
+
+} // namespace
+
+void SortManifest(std::vector<ExifHash>* hashes) {
+  std::sort(hashes->begin(), hashes->end(),
+            [](const ExifHash& lhs, const ExifHash& rhs) {
+              return Compare(lhs, rhs) < 0;
+            });
+  hashes->erase(std::unique(hashes->begin(), hashes->end()), hashes->end());
+}
+
+bool IsManifest(const ExifHash* hashes, size_t count) {
+  for (size_t i = 1; i < count; ++i) {
+    if (Compare(hashes[i - 1], hashes[i]) >= 0)
+      return false;
+  }
+  return true;
+}
+
+namespace {
+
+// Merges the sorted hashes a(0), a(1), ... with b(0), b(1), ... (see below).
+template<typename A, typename B>
+void Merge(A a, size_t a_count, B b, size_t b_count,
+           std::vector<size_t>* a_only, std::vector<size_t>* b_only) {
+  size_t i = 0, j = 0;
+  while (i < a_count && j < b_count) {
+    ExifHash hash = a(i);
+    int cmp = Compare(hash, b(j));
+    if (cmp < 0) {
+      a_only->push_back(i++);
+    } else if (cmp > 0) {
+      b_only->push_back(j++);
+    } else {
+      while (++i < a_count && a(i) == hash)
+        ;
+      while (++j < b_count && b(j) == hash)
+        ;
+    }
+  }
+  for (; i < a_count; ++i)
+    a_only->push_back(i);
+  for (; j < b_count; ++j)
+    b_only->push_back(j);
+}
+
+} // namespace
+
+// Merges the sorted hashes (repeats allowed), appending the indices of those
+// only in a to a_only and of those only in b to b_only.
+void DiffManifests(const ExifHash* a, size_t a_count,
+                   const ExifHash* b, size_t b_count,
+                   std::vector<size_t>* a_only, std::vector<size_t>* b_only) {
+  Merge([a](size_t i) { return a[i]; }, a_count,
+        [b](size_t j) { return b[j]; }, b_count, a_only, b_only);
+}
+
+// As above, for the images of manifest files (by their indices).
+void DiffManifests(const ManifestFile& a, const ManifestFile& b,
+                   std::vector<size_t>* a_only, std::vector<size_t>* b_only) {
+  Merge([&a](size_t i) { return a.hash(i); }, a.size(),
+        [&b](size_t j) { return b.hash(j); }, b.size(), a_only, b_only);
+}
+
+namespace {
+
+const char kMagic[4] = { 'J', 'P', 'G', 'M' };
+const unsigned char kVersion = 1;
+enum Flag : unsigned char { kHasStat = 1 << 0 };
+
+// all numbers are little endian, and all columns start 8-byte aligned
+struct Header {
+  char magic[4];
+  unsigned char version;
+  unsigned char digest_id;
+  unsigned char digest_size;
+  unsigned char flags;
+  uint64_t count;
+  uint64_t strings_size;
+  uint64_t reserved;
+};
+
+inline size_t Align(size_t size) { return (size + 7) & ~size_t(7); }
+
+void WriteWords(std::ostream& os, const std::vector<uint64_t>& words) {
+  for (auto word : words) {
+    word = htole64(word);
+    os.write(reinterpret_cast<const char*>(&word), sizeof(word));
+  }
+}
+
+} // namespace
+
+const size_t ManifestFile::npos;
+
+// Maps the manifest, throwing if it is invalid or for another digest.
+ManifestFile::ManifestFile(const std::string& path)
+    : map_(MAP_FAILED),
+      map_size_(0) {
+  int file_fd;
+  sys_call_rv(file_fd, open, path.c_str(), O_RDONLY);
+  FD fd = file_fd;
+  struct stat stat_buf;
+  sys_call(fstat, fd, &stat_buf);
+  Header header;
+  ssize_t read_count;
+  sys_call_rv(read_count, pread, fd, &header, sizeof(header), 0);
+  if (read_count != sizeof(header) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion) {
+    throw std::runtime_error("invalid manifest: " + path);
+  }
+  typedef ExifHash::DigestType Digest;
+  if (header.digest_id != Digest::kId || header.digest_size != Digest::kSize)
+    throw std::runtime_error(path + " is not a manifest of " + Digest::name());
+
+  // check the columns fill the file, before pointing into it
+  map_size_ = stat_buf.st_size;
+  size_ = le64toh(header.count);
+  strings_size_ = le64toh(header.strings_size);
+  has_stat_ = header.flags & kHasStat;
+  size_t column_size = size_ * sizeof(uint64_t);
+  if (size_ > map_size_ / sizeof(ExifHash) ||
+      strings_size_ > map_size_ ||
+      map_size_ != sizeof(Header) + Align(size_ * sizeof(ExifHash)) +
+                   (2 + 2 * has_stat_) * column_size + strings_size_) {
+    throw std::runtime_error("invalid manifest: " + path);
+  }
+  sys_call2_rv(MAP_FAILED, map_, mmap, NULL, map_size_, PROT_READ, MAP_SHARED,
+               fd, 0);
+  auto bytes = static_cast<const unsigned char*>(map_) + sizeof(Header);
+  digests_ = bytes;
+  bytes += Align(size_ * sizeof(ExifHash));
+  path_offsets_ = reinterpret_cast<const uint64_t*>(bytes);
+  path_order_ = path_offsets_ + size_;
+  stats_ = has_stat_ ? path_order_ + size_ : NULL;
+  strings_ = reinterpret_cast<const char*>(path_order_ + size_ +
+                                           (has_stat_ ? 2 * size_ : 0));
+  // so that every path starts and ends within the table, and lookups by path
+  // (on the hasher threads) never fail
+  bool valid = !size_ ||
+      (strings_size_ != 0 && strings_[strings_size_ - 1] == '\0');
+  for (size_t i = 0; valid && i < size_; ++i) {
+    valid = Word(path_offsets_, i) < strings_size_ &&
+            Word(path_order_, i) < size_;
+  }
+  if (!valid) {
+    munmap(map_, map_size_);
+    throw std::runtime_error("invalid manifest: " + path);
+  }
+}
+
+ManifestFile::~ManifestFile() {
+  if (map_ != MAP_FAILED)
+    munmap(map_, map_size_);
+}
+
+// Writes the entries (in any order) to a new manifest replacing any at path,
+// with their sizes and times if with_stat.
+void ManifestFile::Write(const std::string& path, std::vector<Entry>* entries,
+                         bool with_stat) {
+  std::sort(entries->begin(), entries->end(),
+            [](const Entry& lhs, const Entry& rhs) {
+              return lhs.hash < rhs.hash ||
+                  (lhs.hash == rhs.hash && lhs.path < rhs.path);
+            });
+  size_t count = entries->size();
+  std::vector<uint64_t> path_offsets(count), path_order(count), stats;
+  uint64_t strings_size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    path_offsets[i] = strings_size;
+    strings_size += (*entries)[i].path.size() + 1;
+    path_order[i] = i;
+    if (with_stat) {
+      stats.push_back((*entries)[i].size);
+      stats.push_back((*entries)[i].mtime);
+    }
+  }
+  std::sort(path_order.begin(), path_order.end(), [&](size_t lhs, size_t rhs) {
+      return (*entries)[lhs].path < (*entries)[rhs].path;
+    });
+
+  typedef ExifHash::DigestType Digest;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.digest_id = Digest::kId;
+  header.digest_size = Digest::kSize;
+  header.flags = with_stat ? kHasStat : 0;
+  header.count = htole64(count);
+  header.strings_size = htole64(strings_size);
+
+  auto tmp_path = path + ".tmp";
+  {
+    std::ofstream ofs(tmp_path, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    unsigned char digest[sizeof(ExifHash)];
+    for (const auto& entry : *entries) {
+      entry.hash.ToDigest(digest);
+      ofs.write(reinterpret_cast<const char*>(digest), sizeof(digest));
+    }
+    const char padding[8] = {};
+    ofs.write(padding,
+              Align(count * sizeof(ExifHash)) - count * sizeof(ExifHash));
+    WriteWords(ofs, path_offsets);
+    WriteWords(ofs, path_order);
+    WriteWords(ofs, stats);
+    for (const auto& entry : *entries)
+      ofs.write(entry.path.c_str(), entry.path.size() + 1);
+    if (!ofs.flush())
+      throw std::runtime_error("failed to write " + tmp_path);
+  }
+  sys_call(rename, tmp_path.c_str(), path.c_str());
+}
+
+// Returns the index of the first image with the hash, or npos.
+size_t ManifestFile::Find(const ExifHash& hash) const {
+  unsigned char key[sizeof(ExifHash)];
+  hash.ToDigest(key);
+  size_t begin = 0, end = size_;
+  while (begin < end) {
+    size_t mid = begin + (end - begin) / 2;
+    if (memcmp(digest(mid), key, sizeof(key)) < 0)
+      begin = mid + 1;
+    else
+      end = mid;
+  }
+  return begin < size_ && memcmp(digest(begin), key, sizeof(key)) == 0 ?
+      begin : npos;
+}
+
+// Returns the index of the image at the path, or npos.
+size_t ManifestFile::FindPath(const char* path) const {
+  size_t begin = 0, end = size_;
+  while (begin < end) {
+    size_t mid = begin + (end - begin) / 2;
+    if (strcmp(this->path(Word(path_order_, mid)), path) < 0)
+      begin = mid + 1;
+    else
+      end = mid;
+  }
+  if (begin == size_)
+    return npos;
+  size_t ind = Word(path_order_, begin);
+  return strcmp(this->path(ind), path) == 0 ? ind : npos;
+}
+
+size_t ManifestFile::size() const { return size_; }
+bool ManifestFile::has_stat() const { return has_stat_; }
+ExifHash ManifestFile::hash(size_t ind) const { return ExifHash(digest(ind)); }
+
+const char* ManifestFile::path(size_t ind) const {
+  return strings_ + Word(path_offsets_, ind);
+}
+
+uint64_t ManifestFile::file_size(size_t ind) const {
+  return Word(stats_, 2 * ind);
+}
+
+int64_t ManifestFile::mtime(size_t ind) const {
+  return Word(stats_, 2 * ind + 1);
+}
+
+const unsigned char* ManifestFile::digest(size_t ind) const {
+  return digests_ + ind * sizeof(ExifHash);
+}
+
+uint64_t ManifestFile::Word(const uint64_t* column, size_t ind) const {
+  return le64toh(column[ind]);
+}
@@ -0,0 +1,74 @@
+#ifndef MANIFEST_HPP_
+#define MANIFEST_HPP_
+
+#include "exif_hash.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+// A manifest lists the hashes of a library in ascending order, without
+// repeats, so that two of them are compared by a single merge.
+void SortManifest(std::vector<ExifHash>* hashes);
+bool IsManifest(const ExifHash* hashes, size_t count);
+void DiffManifests(const ExifHash* a, size_t a_count,
+                   const ExifHash* b, size_t b_count,
+                   std::vector<size_t>* a_only, std::vector<size_t>* b_only);
+class ManifestFile;
+void DiffManifests(const ManifestFile& a, const ManifestFile& b,
+                   std::vector<size_t>* a_only, std::vector<size_t>* b_only);
+
+// A manifest kept in a file (.jm), along with the paths of the images and
+// optionally their size and modification time: a header, the digests sorted
+// (as fixed-width bytes), the offsets of the paths in a string table, the
+// images in the order of their paths, the sizes and times, and the string
+// table. It is mapped rather than loaded, and searched where it lies.
+class ManifestFile {
+ public:
+  struct Entry {
+    ExifHash hash;
+    std::string path;
+    uint64_t size;
+    int64_t mtime; // in nanoseconds
+  };
+
+  static const size_t npos = ~size_t(0);
+
+  explicit ManifestFile(const std::string& path);
+  ~ManifestFile();
+
+  static void Write(const std::string& path, std::vector<Entry>* entries,
+                    bool with_stat);
+
+  size_t Find(const ExifHash& hash) const;
+  size_t FindPath(const char* path) const;
+
+  size_t size() const;
+  bool has_stat() const;
+  ExifHash hash(size_t ind) const;
+  const char* path(size_t ind) const;
+  uint64_t file_size(size_t ind) const;
+  int64_t mtime(size_t ind) const;
+
+ private:
+  ManifestFile(const ManifestFile&);
+  ManifestFile& operator=(const ManifestFile&);
+
+  const unsigned char* digest(size_t ind) const;
+  uint64_t Word(const uint64_t* column, size_t ind) const;
+
+  void* map_;
+  size_t map_size_;
+  size_t size_;
+  bool has_stat_;
+  const unsigned char* digests_;
+  const uint64_t* path_offsets_;
+  const uint64_t* path_order_;
+  const uint64_t* stats_; // size and time, interleaved
+  const char* strings_;
+  size_t strings_size_;
+};
+
+#endif // MANIFEST_HPP_
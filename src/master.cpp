@@ -1,6 +1,7 @@
 #include "master.hpp"
 
 #include "debug.hpp"
+#include "library.hpp"
 #include "protocol.hpp"
 #include "util/logger.hpp"
 #include "util/string_utils.hpp"
@@ -10,6 +11,14 @@
 #include <cstring>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 
 namespace {
 
@@ -18,10 +27,15 @@ uint16_t BindAndListen(int sock, uint16_t port) {
   socklen_t my_address_len = sizeof(my_address);
   memset(&my_address, 0, sizeof(my_address));
   my_address.sin_family = PF_INET;
-  my_address.sin_port = port;
+  my_address.sin_port = htons(port);
   my_address.sin_addr.s_addr = INADDR_ANY;
+  if (port != 0) { // so that a restarted master can listen right away
+    int reuse = 1;
+    sys_call(setsockopt, sock, SOL_SOCKET, SO_REUSEADDR, &reuse,
+             sizeof(reuse));
+  }
   sys_call(bind, sock, (sockaddr*)&my_address, my_address_len);
-  sys_call(listen, sock, 2);
+  sys_call(listen, sock, SOMAXCONN);
   if (port == 0) {
     sys_call(getsockname, sock, (sockaddr*)&my_address, &my_address_len);
     port = ntohs(my_address.sin_port);
@@ -35,9 +49,66 @@ inline int Accept(int sock) {
   return fd;
 }
 
+// Reads the id by which the slave tells which of its sessions the connection
+// belongs to, which it sends first on each sync connection.
+inline bool ReadSessionId(int sync_fd, uint64_t* session_id) {
+  return SyncProtocol::ReadExactly(sync_fd, session_id, sizeof(*session_id));
+}
+
+// how long the first sync connection of a session waits for the second one
+const std::chrono::seconds kPairTimeout(30);
+
+void SendUpdatePort(int sync_fd, uint16_t update_port) {
+  uint16_t port = htons(update_port);
+  if (!SyncProtocol::WriteExactly(sync_fd, &port, sizeof(port)))
+    throw SyncError("Failed to send update port to slave");
+}
+
+// A slave served by Master::Serve, whose sync connections are accepted
+// already and which gets an update port of its own.
+class Session : public Peer {
+ public:
+  Session(Logger* logger, int sync_fd0, int sync_fd1)
+      : Peer(logger),
+        next_sync_fd_(0) {
+    sync_fds_[0] = sync_fd0;
+    sync_fds_[1] = sync_fd1;
+    update_sock_ = UpdateProtocol::InitSocket();
+    update_port_ = BindAndListen(update_sock_, 0);
+  }
+
+  // closes the sync connections that Sync did not take (if it failed first)
+  ~Session() {
+    for (int i = next_sync_fd_; i < 2; ++i)
+      close(sync_fds_[i]);
+  }
+
+ protected:
+  void InitUpdateConnection(int* update_fd) {
+    *update_fd = Accept(update_sock_);
+    update_sock_.Close();
+  }
+
+  bool InitSyncConnection(int* sync_fd, bool download) {
+    *sync_fd = sync_fds_[next_sync_fd_++];
+    SendUpdatePort(*sync_fd, update_port_);
+    return Peer::InitSyncConnection(sync_fd, download);
+  }
+
+ private:
+  int sync_fds_[2];
+  std::atomic<int> next_sync_fd_;
+  FD update_sock_;
+  uint16_t update_port_;
+};
+
 } // namespace
 
-Master::Master(Logger* logger) : Peer(logger), sync_port_(0) {}
+Master::Master(Logger* logger)
+    : Peer(logger),
+      sync_port_(0),
+      session_id_(0),
+      sync_conn_count_(0) {}
 
 void Master::set_port(uint16_t port) { sync_port_ = port; }
 
@@ -51,7 +122,7 @@ uint16_t Master::Listen() {
 
 void Master::InitUpdateConnection(int* update_fd) {
   if (update_sock_.closed())
-    logger_->Fatal("Cannot connect to multiple slaves");
+    throw SyncError("Cannot connect to multiple slaves (see --serve)");
 
   // close update_sock_ on exit (even in case of exception)
   auto on_exit = [=] { update_sock_.Close(); };
@@ -71,10 +142,124 @@ bool Master::InitSyncConnection(int* sync_fd, bool download) {
   *sync_fd = Accept(sync_sock_);
   DEBUG_OUT_LN(INITSYNC, "ACCEPTED SYNC CONN");
 
-  // send the bound update port
-  uint16_t port = htons(update_port_);
-  if (!SyncProtocol::WriteExactly(*sync_fd, &port, sizeof(port)))
-    logger_->Fatal("Failed to send update port to slave");
+  // both sync connections must come from the same slave session
+  uint64_t session_id;
+  if (!ReadSessionId(*sync_fd, &session_id))
+    throw SyncError("Failed to receive session id from slave");
+  {
+    std::lock_guard<decltype(session_mutex_)> locker(session_mutex_);
+    if (sync_conn_count_++ == 0)
+      session_id_ = session_id;
+    else if (session_id != session_id_)
+      throw SyncError("Cannot connect to multiple slaves (see --serve)");
+  }
 
+  // send the bound update port
+  SendUpdatePort(*sync_fd, update_port_);
   return Peer::InitSyncConnection(sync_fd, download);
 }
+
+// Syncs with any number of slaves until killed, sharing the library which is
+// scanned only once.
+void Master::Serve(PathGenerator path_gen, const std::string& download_dir) {
+  Library library(download_dir, sharded_);
+  library.Scan(UpdateProtocol::hashes_per_packet, path_gen, exif_delta_,
+               content_hash_);
+  Serve(&library, 0);
+}
+
+// Syncs with session_count slaves (or any number until killed, if zero), each
+// in a session of its own so that a slow or failing one does not hold up the
+// others.
+void Master::Serve(Library* library, size_t session_count) {
+  update_sock_.Close(); // each session listens for its own
+
+  // pair up the sync connections of each session as they are accepted, and
+  // count each connection accepted once it is done with (held by the
+  // threads, which may outlive this call)
+  struct State {
+    State() : accepted_count(0), finished_count(0) {}
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::unordered_map<uint64_t, int> pending;
+    size_t accepted_count;
+    size_t finished_count;
+  };
+  auto state = std::make_shared<State>();
+  auto wait_finished = [state] {
+    std::unique_lock<std::mutex> locker(state->mutex);
+    state->changed.wait(locker, [state] {
+        return state->finished_count == state->accepted_count;
+      });
+  };
+
+  try {
+    for (size_t conn_count = 0;
+         !session_count || conn_count < 2 * session_count; ++conn_count) {
+      int fd = Accept(sync_sock_);
+      {
+        std::lock_guard<std::mutex> locker(state->mutex);
+        ++state->accepted_count;
+      }
+      std::thread([=] {
+          uint64_t session_id;
+          if (!ReadSessionId(fd, &session_id)) {
+            close(fd);
+            std::lock_guard<std::mutex> locker(state->mutex);
+            ++state->finished_count;
+            state->changed.notify_all();
+            return;
+          }
+          int first_fd;
+          {
+            std::unique_lock<std::mutex> locker(state->mutex);
+            auto it = state->pending.find(session_id);
+            if (it == state->pending.end()) {
+              // wait for the other connection, which takes over this one
+              state->pending.insert(std::make_pair(session_id, fd));
+              if (!state->changed.wait_for(locker, kPairTimeout, [=] {
+                    return !state->pending.count(session_id);
+                  })) {
+                logger_->Warn("session " + ToString(session_id) +
+                              " did not open its second connection");
+                state->pending.erase(session_id);
+                close(fd);
+                ++state->finished_count;
+                state->changed.notify_all();
+              }
+              return;
+            }
+            first_fd = it->second;
+            state->pending.erase(it);
+            state->changed.notify_all();
+          }
+
+          auto session_str = "session " + ToString(session_id);
+          logger_->Verbose("started " + session_str);
+          try {
+            Session session(logger_, first_fd, fd);
+            session.set_sharded(sharded_);
+            session.set_exif_delta(exif_delta_);
+            session.set_content_hash(content_hash_);
+            session.set_sorted_update(sorted_update_);
+            session.set_mesh(mesh_);
+            session.set_watch(watch_);
+            session.Sync(library);
+            logger_->Verbose("finished " + session_str);
+          } catch (const std::exception& e) {
+            logger_->Error(session_str + " failed: " + e.what());
+          }
+
+          std::lock_guard<std::mutex> locker(state->mutex);
+          state->finished_count += 2;
+          state->changed.notify_all();
+        }).detach();
+    }
+  } catch (...) {
+    // the sessions use the library (and this master) until they are done
+    wait_finished();
+    throw;
+  }
+  wait_finished();
+}
@@ -5,12 +5,20 @@
 
 #include "util/fd.hpp"
 
+#include <cstddef>
 #include <cstdint>
 
+#include <mutex>
+#include <string>
+
+class Library;
+
 class Master : public Peer {
  public:
   Master(Logger* logger);
   uint16_t Listen();
+  void Serve(PathGenerator path_gen, const std::string& download_dir);
+  void Serve(Library* library, size_t session_count);
   void set_port(uint16_t port);
  protected:
   void InitUpdateConnection(int* update_fd);
@@ -20,6 +28,10 @@ class Master : public Peer {
   uint16_t sync_port_;
   FD sync_sock_;
   FD update_sock_;
+
+  std::mutex session_mutex_;
+  uint64_t session_id_;
+  size_t sync_conn_count_;
 };
 
 #endif // MASTER_HPP_
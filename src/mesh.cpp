@@ -0,0 +1,53 @@
+#include "mesh.hpp"
+
+Mesh::Mesh(size_t rank, const std::vector<std::string>& hosts)
+    : rank_(rank),
+      hosts_(hosts),
+      hashes_(hosts.size()),
+      update_count_(0) {}
+
+// Takes over the hashes received from the member of the given rank.
+void Mesh::SetHashes(size_t rank, FrozenHashSet* hashes) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  hashes_[rank].swap(*hashes);
+  ++update_count_;
+  updated_.notify_all();
+}
+
+// Gives up on the update of a member whose session failed (as if it had no
+// images), so that the others need not wait for it.
+void Mesh::Abandon() {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  ++update_count_;
+  updated_.notify_all();
+}
+
+// Waits until the updates of all other members are received or abandoned.
+void Mesh::Wait() {
+  std::unique_lock<decltype(mutex_)> locker(mutex_);
+  updated_.wait(locker, [this] { return update_count_ + 1 >= size(); });
+}
+
+// Returns whether this member, which has the image, is the one to send it to
+// the receiver. Must only be called after Wait.
+bool Mesh::Offers(const ExifHash& hash, size_t receiver) const {
+  if (hashes_[receiver].Contains(hash))
+    return false;
+
+  for (size_t rank = 0; rank < size(); ++rank) {
+    if (rank == rank_ || rank == receiver || !hashes_[rank].Contains(hash))
+      continue;
+    unsigned distance = Distance(rank, receiver);
+    unsigned my_distance = Distance(rank_, receiver);
+    if (distance < my_distance || (distance == my_distance && rank < rank_))
+      return false;
+  }
+  return true;
+}
+
+size_t Mesh::rank() const { return rank_; }
+size_t Mesh::size() const { return hosts_.size(); }
+
+unsigned Mesh::Distance(size_t from, size_t to) const {
+  return hosts_[from] != hosts_[to];
+}
@@ -0,0 +1,41 @@
+#ifndef MESH_HPP_
+#define MESH_HPP_
+
+#include "exif_hash.hpp"
+#include "frozen_hash_set.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// One member of a mesh of replicas that sync with each other all at once.
+// Knowing what every member has, it decides which of the members that have
+// an image sends it to each member that lacks it: the nearest one (on the
+// same host, if any), breaking ties by the lowest rank. So every image is
+// sent exactly once to every member lacking it, straight from a holder.
+class Mesh {
+ public:
+  Mesh(size_t rank, const std::vector<std::string>& hosts);
+
+  void SetHashes(size_t rank, FrozenHashSet* hashes);
+  void Abandon();
+  void Wait();
+  bool Offers(const ExifHash& hash, size_t receiver) const;
+
+  size_t rank() const;
+  size_t size() const;
+
+ private:
+  unsigned Distance(size_t from, size_t to) const;
+
+  size_t rank_;
+  std::vector<std::string> hosts_;
+  std::vector<FrozenHashSet> hashes_;
+
+  std::mutex mutex_;
+  std::condition_variable updated_;
+  size_t update_count_;
+};
+
+#endif // MESH_HPP_
@@ -0,0 +1,29 @@
+#include "name_index.hpp"
+
+NameIndex::NameIndex(const std::string& dir) : prefix_(dir + '/') {}
+
+// Marks the name of the file at path as taken if it is in the directory.
+bool NameIndex::AddPath(const std::string& path) {
+  if (path.compare(0, prefix_.size(), prefix_) != 0 ||
+      path.find('/', prefix_.size()) != std::string::npos) {
+    return false;
+  }
+
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  names_.insert(path.substr(prefix_.size()));
+  return true;
+}
+
+// Frees the name of the file at path (e.g. deleted).
+void NameIndex::RemovePath(const std::string& path) {
+  if (path.compare(0, prefix_.size(), prefix_) != 0)
+    return;
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  names_.erase(path.substr(prefix_.size()));
+}
+
+// Marks the name as taken, unless it already was.
+bool NameIndex::Reserve(const std::string& name) {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  return names_.insert(name).second;
+}
@@ -0,0 +1,25 @@
+#ifndef NAME_INDEX_HPP_
+#define NAME_INDEX_HPP_
+
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+// Names taken in a directory, so that free names for new files can be picked
+// without probing the filesystem.
+class NameIndex {
+ public:
+  NameIndex(const std::string& dir);
+
+  bool AddPath(const std::string& path);
+  void RemovePath(const std::string& path);
+  bool Reserve(const std::string& name);
+
+ private:
+  std::string prefix_;
+
+  std::mutex mutex_;
+  std::unordered_set<std::string> names_;
+};
+
+#endif // NAME_INDEX_HPP_
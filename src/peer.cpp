@@ -1,27 +1,49 @@
 #include "peer.hpp"
 
 #include "debug.hpp"
+#include "entry_spool.hpp"
 #include "exif_hash.hpp"
 #include "exif_hasher.hpp"
+#include "frozen_hash_set.hpp"
+#include "jpeg.hpp"
+#include "library.hpp"
+#include "manifest.hpp"
+#include "mesh.hpp"
+#include "prefetcher.hpp"
 #include "protocol.hpp"
+#include "spilled_hash_set.hpp"
+#include "writer_pool.hpp"
 #include "util/fd.hpp"
 #include "util/logger.hpp"
-#include "util/fd.hpp"
-#include "util/fstream_utils.hpp"
 #include "util/string_utils.hpp"
 #include "util/syscall.hpp"
 
+#include <algorithm>
 #include <atomic>
-#include <fstream>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include <cerrno>
 #include <climits>
 #include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
 
 namespace {
 
@@ -39,31 +61,236 @@ inline std::string ToPath(const std::string& dir, const char* filename) {
   return dir + '/' + filename;
 }
 
-const char* kDevNull = "/dev/null";
+// maximum number of accepted files being read in ahead of the upload
+const size_t kPrefetchDepth = 8;
+
+// where partially downloaded images are kept, and the size from which images
+// are received there rather than in memory (smaller ones are not worth it)
+const char* kStagingDir = ".jpgsync-partial";
+const size_t kStagingThreshold = 1 << 20;
+const size_t kChunkSize = 1 << 18;
+
+inline std::string ToStagedName(const ExifHash& hash) {
+  return std::string(kStagingDir) + '/' + ToString(hash);
+}
+
+// the version of the file a download is of (its size and modification time,
+// in seconds and nanoseconds), sent along with its size and kept with the
+// staged part, so that only a download of the very same file is resumed
+const size_t kSourceWords = 3;
+const char* kSourceAttr = "user.jpgsync.source";
+
+void ToSource(int fd, size_t file_size, size_t* source) {
+  struct stat stat_buf;
+  bool known = (fstat(fd, &stat_buf) == 0);
+  source[0] = file_size;
+  source[1] = known ? static_cast<uint32_t>(stat_buf.st_mtim.tv_sec) : 0;
+  source[2] = known ? stat_buf.st_mtim.tv_nsec : 0;
+}
+
+// the staged size of a missing image and the version of the file it is of
+const size_t kOffsetWords = 1 + kSourceWords;
+
+void MakeDir(const std::string& path) {
+  if (mkdir(path.c_str(), 0777) == -1 && errno != EEXIST)
+    throw SysCallException(__FILE__, __LINE__, "mkdir(" + path + ")");
+}
+
+// offset requesting only the EXIF segment of an image, sent instead of the
+// staged size when the receiver has another image with the same image data
+const size_t kExifOnlyOffset = 0xFFFFFFFF;
+
+// size sent instead of that of an accepted image which could not be read
+const size_t kMissingSize = 0xFFFFFFFF;
+
+// protocol features, both peers must agree on
+enum Feature : unsigned char {
+  kFeatureExifDelta = 1 << 0,
+  kFeatureMesh = 1 << 1,
+  kFeatureContentHash = 1 << 2,
+  kFeatureSortedUpdate = 1 << 3,
+};
+
+void ReadFile(const std::string& path, std::vector<char>* file) {
+  int fd;
+  sys_call_rv(fd, open, path.c_str(), O_RDONLY);
+  FD file_fd = fd;
+  struct stat stat_buf;
+  sys_call(fstat, file_fd, &stat_buf);
+  file->resize(stat_buf.st_size);
+  for (size_t offset = 0; offset < file->size(); ) {
+    ssize_t read_count;
+    sys_call_rv(read_count, read, file_fd, file->data() + offset,
+                file->size() - offset);
+    if (!read_count)
+      throw std::runtime_error("unexpected end of " + path);
+    offset += read_count;
+  }
+}
+
+// number of threads storing downloads and files synced to disk at once
+const size_t kWriterCount = 4;
+const size_t kWriterBatchSize = 64;
+
+// shares of the memory budget for the own hashes and those of the peer, the
+// rest being left for the images in flight
+const size_t kOwnHashesBudgetShare = 4;
+const size_t kPeerHashesBudgetShare = 4;
+
+// how often an uploader waiting for images to be added (while watching)
+// checks whether the peer quit
+const std::chrono::milliseconds kWatchPollInterval(200);
+
+// Sends the sorted hashes in order, as many to a packet as fit.
+void SendManifest(int update_fd, const ExifHash* manifest, size_t count) {
+  unsigned char buf[UpdateProtocol::hashes_per_packet * sizeof(ExifHash)];
+  for (size_t ind = 0; ind < count; ) {
+    auto bytes = buf;
+    do {
+      manifest[ind].ToDigest(bytes);
+      bytes += sizeof(ExifHash);
+    } while (++ind != count && bytes != buf + sizeof(buf));
+    DEBUG_OUT_LN(UPDSEND, "update=%s | SENDING",
+                 DEBUG_HEX_STR(buf, bytes - buf));
+    UpdateProtocol::WriteFully(update_fd, buf, bytes - buf);
+  }
+}
+
+bool IsReadable(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
 
 } // namespace
 
 
-Peer::Peer(Logger* logger) : logger_(logger) {}
+Peer::Peer(Logger* logger)
+    : logger_(logger),
+      sharded_(false),
+      exif_delta_(false),
+      content_hash_(false),
+      sorted_update_(false),
+      memory_budget_(0),
+      mesh_(NULL),
+      peer_rank_(0),
+      watch_(false) {}
 Peer::~Peer() {}
 
+void Peer::set_sharded(bool sharded) { sharded_ = sharded; }
+void Peer::set_exif_delta(bool exif_delta) { exif_delta_ = exif_delta; }
+void Peer::set_content_hash(bool content_hash) {
+  content_hash_ = content_hash;
+}
+void Peer::set_sorted_update(bool sorted_update) {
+  sorted_update_ = sorted_update;
+}
+void Peer::set_memory_budget(size_t memory_budget) {
+  memory_budget_ = memory_budget;
+}
+void Peer::set_mesh(Mesh* mesh) { mesh_ = mesh; }
+void Peer::set_watch(bool watch) { watch_ = watch; }
+
 bool Peer::InitSyncConnection(int* sync_fd, bool download) {
   if (!SyncProtocol::WriteByte(*sync_fd, download))
-    logger_->Fatal("Failed to send connection id to peer");
+    throw SyncError("Failed to send connection id to peer");
   bool peer_download;
   if (!SyncProtocol::ReadByte(*sync_fd, &peer_download))
-    logger_->Fatal("Failed to receive peer connection id");
+    throw SyncError("Failed to receive peer connection id");
+
+  unsigned char features = ((exif_delta_ ? kFeatureExifDelta : 0) |
+                            (mesh_ != NULL ? kFeatureMesh : 0) |
+                            (content_hash_ ? kFeatureContentHash : 0) |
+                            (sorted_update_ ? kFeatureSortedUpdate : 0));
+  unsigned char peer_features;
+  if (!SyncProtocol::WriteByte(*sync_fd, features) ||
+      !SyncProtocol::ReadByte(*sync_fd, &peer_features)) {
+    throw SyncError("Failed to exchange protocol features with peer");
+  }
+  if (peer_features != features)
+    throw SyncError("Peer uses different protocol features (e.g. -e, -c)");
+
+  // check both identify images by the same digest (chosen when building)
+  typedef ExifHash::DigestType Digest;
+  unsigned char peer_digest;
+  if (!SyncProtocol::WriteByte(*sync_fd, Digest::kId) ||
+      !SyncProtocol::ReadByte(*sync_fd, &peer_digest)) {
+    throw SyncError("Failed to exchange digest algorithm with peer");
+  }
+  if (peer_digest != Digest::kId) {
+    throw SyncError(std::string("Peer identifies images by another digest "
+                                "than ") + Digest::name());
+  }
+
+  // tell each other the ranks in the mesh
+  if (mesh_ != NULL) {
+    size_t peer_rank;
+    if (!SyncProtocol::WriteByte(*sync_fd, mesh_->rank()) ||
+        !SyncProtocol::ReadByte(*sync_fd, &peer_rank)) {
+      throw SyncError("Failed to exchange mesh ranks with peer");
+    }
+    if (peer_rank >= mesh_->size() || peer_rank == mesh_->rank())
+      throw SyncError("Peer has invalid mesh rank: " + ToString(peer_rank));
+    if (download)
+      peer_rank_ = peer_rank;
+  }
   return peer_download != download;
 }
 
 void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
-  ExifHasher exif_hasher;
-  exif_hasher.Run(UpdateProtocol::hashes_per_packet, path_gen);
+  Library library(download_dir, sharded_);
+  library.set_bounded(memory_budget_ != 0);
+  library.Scan(UpdateProtocol::hashes_per_packet, path_gen, exif_delta_,
+               content_hash_);
+  Sync(&library);
+}
+
+// Syncs the library with the peer, throwing SyncError if the session fails.
+void Peer::Sync(Library* library) {
+  const auto& download_dir = library->dir();
+  auto& exif_hasher = library->exif_hasher();
+  auto& name_index = library->name_index();
+  auto store = library->store();
+
+  // count this session in as updated in the mesh, even if it fails early
+  bool mesh_updated = false;
+  auto on_exit = [&] {
+    if (mesh_ != NULL && !mesh_updated)
+      mesh_->Abandon();
+  };
+  struct ScopeExit {
+    ScopeExit(decltype(on_exit) f) : f(f) {}
+    ~ScopeExit() { f(); }
+    decltype(on_exit) f;
+  } scope_exit(on_exit);
+
+  // offered images carry their image data hash as well in EXIF delta mode
+  const size_t offer_entry_size = (1 + exif_delta_) * sizeof(ExifHash);
+  const size_t offer_capacity = SyncProtocol::hashes_per_packet /
+      (1 + exif_delta_);
 
   std::mutex hasher_progress_mutex;
   std::condition_variable hasher_progress;
   std::atomic<size_t> hasher_entry_count(0);
   bool hashing = true;
+  std::atomic<bool> peer_done(false);
+
+  // with memory bounded, the hashes of both sides are kept in spilled sets
+  // and the own entries in a spool, from which they are uploaded, so that
+  // the hasher can free them once sent in the update
+  bool bounded = memory_budget_ != 0;
+  std::unique_ptr<SpilledHashSet> own_hashes, peer_hashes;
+  std::unique_ptr<EntrySpool> entry_spool;
+  if (bounded) {
+    own_hashes.reset(new SpilledHashSet(
+        download_dir, memory_budget_ / kOwnHashesBudgetShare));
+    peer_hashes.reset(new SpilledHashSet(
+        download_dir, memory_budget_ / kPeerHashesBudgetShare));
+    entry_spool.reset(new EntrySpool(download_dir));
+  }
+
+  // images downloaded in this session, not to be offered back to the peer
+  std::mutex downloaded_mutex;
+  std::unordered_set<ExifHash> downloaded_hashes;
 
   std::mutex init_update_mutex;
   FD update_fd;
@@ -76,63 +303,151 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
     }
   };
 
-  // initialize connections in parallel
-  int download_fd, upload_fd;
+  // initialize connections in parallel, closing them again if either fails
+  int download_fd = -1, upload_fd = -1;
+  auto close_sync_fds = [&] {
+    if (download_fd != -1)
+      close(download_fd);
+    if (upload_fd != -1)
+      close(upload_fd);
+  };
+  std::exception_ptr init_error;
   std::thread sync_initializer([&] {
-      InitSyncConnection(&download_fd, true);
-      update_initializer();
+      try {
+        InitSyncConnection(&download_fd, true);
+        update_initializer();
+      } catch (...) {
+        init_error = std::current_exception();
+      }
     });
-  bool matched = InitSyncConnection(&upload_fd, false);
-  update_initializer();
+  bool matched;
+  try {
+    matched = InitSyncConnection(&upload_fd, false);
+    update_initializer();
+  } catch (...) {
+    sync_initializer.join();
+    close_sync_fds();
+    throw;
+  }
+  sync_initializer.join();
+  if (init_error) {
+    close_sync_fds();
+    std::rethrow_exception(init_error);
+  }
 
   // ensure download_fd is connected to peer's upload_fd and vice-versa
-  sync_initializer.join();
   if (!matched)
     std::swap(download_fd, upload_fd);
   DEBUG_OUT_LN(SYNC, "match=%d | INIT'D SYNC CONNECTIONS", (int)matched);
 
-  std::thread downloader([&] {
-      FD sync_fd = download_fd;
+  // keep the connections open until all threads are done, so that a failing
+  // one can shut them down to make the others (blocked on them) fail too
+  FD download_sock = download_fd, upload_sock = upload_fd;
+  std::mutex error_mutex;
+  std::string error;
+  auto guarded = [&](std::function<void()> f) {
+    return [&, f] {
+      try {
+        f();
+      } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> locker(error_mutex);
+        if (error.empty())
+          error = e.what();
+        shutdown(download_sock, SHUT_RDWR);
+        shutdown(upload_sock, SHUT_RDWR);
+        if (!update_fd.closed())
+          shutdown(update_fd, SHUT_RDWR);
+        peer_done = true;
+        std::lock_guard<std::mutex> progress_locker(hasher_progress_mutex);
+        hashing = false;
+        hasher_progress.notify_one();
+      }
+    };
+  };
+
+  std::thread downloader(guarded([&] {
+      int sync_fd = download_sock;
       DEBUG_OUT_LN(SYNCRECV, "fd=%2d | INIT SYNC DONE", (int)sync_fd);
 
-      // send update
+      // send update (in sorted mode, as a manifest once hashing is done)
+      ExifHasher::Cursor cursor;
+      std::vector<ExifHash> manifest;
       while (true) {
         unsigned char buf[UpdateProtocol::
                           hashes_per_packet * sizeof(ExifHash)];
 
         // wait for hasher progress, until next hash_count hashes are found
+        // (freeing those sent before, if memory is bounded)
+        if (bounded && cursor.entry != NULL)
+          exif_hasher.Release(cursor.entry);
         size_t hash_count = UpdateProtocol::hashes_per_packet;
-        auto e = exif_hasher.Get(&hash_count);
+        auto e = exif_hasher.Get(&cursor, &hash_count);
         if (hash_count == 0)
           break;
+        if (bounded) {
+          auto entry = e;
+          for (size_t i = 0; i < hash_count; ++i, entry = entry->next) {
+            own_hashes->Insert(entry->hash);
+            entry_spool->Append(*entry);
+          }
+          entry_spool->Flush();
+        }
 
         // notify the upload thread of the progress / newly found entries
         DEBUG_OUT_LN(UPDSEND, "cnt=%2lu | NOTIFY PROGRESS", hash_count);
         hasher_entry_count.fetch_add(hash_count);
         hasher_progress.notify_one();
 
+        // (leaving out the images removed from the library since hashed)
+        if (sorted_update_) {
+          for (; !bounded && hash_count--; e = e->next) {
+            if (!e->removed)
+              manifest.push_back(e->hash);
+          }
+          continue;
+        }
+
         // advance e to the latest entry, filling buf along the way
-        ssize_t write_count = hash_count * sizeof(ExifHash);
-        auto bytes = buf + write_count;
+        auto bytes_end = buf + hash_count * sizeof(ExifHash);
+        auto bytes = bytes_end;
         auto e_first = e;
-        do {
+        for (size_t i = 0; i < hash_count; ++i, e = e->next) {
           DEBUG_OUT_LN(UPDSEND, "hash=%s; path=%s | NEW ENTRY",
-                       DEBUG_STR(*e->hash), e->path.c_str());
-          e->hash->ToDigest(bytes -= sizeof(ExifHash));
-          e = e->next;
-        } while (bytes != buf);
+                       DEBUG_STR(e->hash), e->path.c_str());
+          if (!e->removed)
+            e->hash.ToDigest(bytes -= sizeof(ExifHash));
+        }
+        ssize_t write_count = bytes_end - bytes;
+        if (!write_count)
+          continue;
 
         // send the new hashes to the receive
         DEBUG_OUT_LN(UPDSEND, "update=%s | SENDING",
-                     DEBUG_HEX_STR(buf, write_count));
-        UpdateProtocol::WriteFully(update_fd, buf, write_count);
-        if (logger_->verbosity() >= 2) { // prune slow path
-          logger_->Verbose("sent " + ToString(hash_count) + " hashes", 2);
-          for (auto e = e_first; hash_count--; e = e->next)
-            logger_->Verbose("sent hash: " + ToString(*e->hash), 3);
+                     DEBUG_HEX_STR(bytes, write_count));
+        UpdateProtocol::WriteFully(update_fd, bytes, write_count);
+        LOG_VERBOSE(logger_, 2, "sent " +
+                    ToString(write_count / sizeof(ExifHash)) + " hashes");
+        if (LOG_ENABLED(logger_, 3)) {
+          for (auto e = e_first; hash_count--; e = e->next) {
+            if (!e->removed)
+              logger_->Verbose("sent hash: " + ToString(e->hash), 3);
+          }
         }
       }
 
+      if (bounded) {
+        own_hashes->Freeze();
+        logger_->Verbose("spilled own hashes " +
+                         ToString(own_hashes->spill_count()) + " times", 2);
+      }
+      if (sorted_update_ && bounded) {
+        SendManifest(update_fd, own_hashes->data(), own_hashes->size());
+        logger_->Verbose("sent sorted update", 2);
+      } else if (sorted_update_) {
+        SortManifest(&manifest);
+        SendManifest(update_fd, manifest.data(), manifest.size());
+        logger_->Verbose("sent sorted update", 2);
+      }
       logger_->Verbose("sent update of size " +
                        ToString(exif_hasher.entry_count()));
 
@@ -151,118 +466,304 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
       DEBUG_OUT_LN(SYNCRECV, "NOTIFIED UPDATE SENT");
 
       logger_->Verbose("started downloading");
-      std::ofstream ofs;
+      WriterPool writer_pool(download_dir, kWriterCount, kWriterBatchSize,
+                             logger_);
+      WriterPool::Job job;
+      MakeDir(ToPath(download_dir, kStagingDir));
+
+      std::vector<ExifHash> offered_hashes, missing_hashes;
+      std::vector<std::pair<ExifHash, std::string> > received;
+      std::vector<const ExifHasher::Entry*> local_copies;
+      std::vector<size_t> offsets;
+      std::vector<char> image, segment;
+
+      // the images claimed by this session (see Library::Claim), released
+      // once stored or given up, so that later sessions can receive them
+      std::unordered_set<ExifHash> claimed;
+      auto unclaim = [&](const ExifHash& hash) {
+        claimed.erase(hash);
+        library->Unclaim(hash);
+      };
+      auto on_exit = [&] {
+        for (const auto& hash : claimed)
+          library->Unclaim(hash);
+      };
+      struct ScopeExit {
+        ScopeExit(decltype(on_exit) f) : f(f) {}
+        ~ScopeExit() { f(); }
+        decltype(on_exit) f;
+      } scope_exit(on_exit);
+
+      // offer the received images in later sessions (with the same library)
+      std::vector<WriterPool::Moved> moved;
+      auto add_received = [&] {
+        writer_pool.Flush(&moved);
+        for (const auto& file : moved) {
+          for (auto& image : received) {
+            if (image.second == file.first)
+              image.second = file.second;
+          }
+        }
+        {
+          std::lock_guard<std::mutex> locker(downloaded_mutex);
+          for (const auto& image : received) {
+            if (!image.second.empty())
+              downloaded_hashes.insert(image.first);
+          }
+        }
+        for (const auto& image : received) {
+          if (!image.second.empty())
+            library->Add(image.first, image.second);
+          unclaim(image.first);
+        }
+        received.clear();
+      };
 
-      std::vector<ExifHash> missing_hashes;
       unsigned char buf[SyncProtocol::hashes_per_packet * sizeof(ExifHash)];
       unsigned char found_bitmask[
           (SyncProtocol::hashes_per_packet + CHAR_BIT - 1) / CHAR_BIT];
 
       for (size_t hash_count; SyncProtocol::
                ReadByte(sync_fd, &hash_count); ) {
-        if (hash_count > SyncProtocol::hashes_per_packet) {
-          logger_->Fatal("sync received invalid offer hash count: " +
+        if (hash_count > offer_capacity) {
+          throw SyncError("sync received invalid offer hash count: " +
                          ToString(hash_count));
         }
 
-        size_t read_count = hash_count * sizeof(ExifHash);
+        size_t read_count = hash_count * offer_entry_size;
         if (!SyncProtocol::ReadExactly(sync_fd, buf, read_count)) {
-          logger_->Fatal("sync received invalid offer packet length: " +
+          throw SyncError("sync received invalid offer packet length: " +
                          ToString(read_count));
         }
         DEBUG_OUT_LN(SYNCRECV, "offer=%s | RECEIVED OFFER",
                      DEBUG_HEX_STR(buf, read_count));
 
-        // figure out missing hashes and confirm found ones via found_bitmask
-        missing_hashes.clear();
+        // figure out missing hashes and confirm found ones via found_bitmask,
+        // looking up all of the offer in the local images at once
+        offered_hashes.clear();
+        auto bytes_end = buf + read_count;
+        for (auto bytes = buf; bytes != bytes_end; bytes += offer_entry_size)
+          offered_hashes.emplace_back(bytes);
         memset(found_bitmask, 0, sizeof(found_bitmask));
+        if (bounded) {
+          for (size_t i = 0; i < hash_count; ++i) {
+            if (own_hashes->Contains(offered_hashes[i]))
+              found_bitmask[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+          }
+        } else {
+          exif_hasher.ContainsBatch(offered_hashes.data(), hash_count,
+                                    found_bitmask);
+        }
+
+        missing_hashes.clear();
+        local_copies.clear();
         auto found = found_bitmask;
         int found_bit = 0;
-        auto bytes_end = buf + read_count;
-        for (auto bytes = buf; bytes != bytes_end; bytes += sizeof(ExifHash)) {
-          missing_hashes.emplace_back(bytes);
-          const auto& hash = missing_hashes.back();
-          if (exif_hasher.Contains(hash)) {
-            logger_->Verbose("rejected download: " + ToString(hash));
+        auto offered_hash = offered_hashes.begin();
+        for (auto bytes = buf; bytes != bytes_end; bytes += offer_entry_size) {
+          const auto& hash = *offered_hash++;
+          // (another session might be receiving it at the same time)
+          if ((*found & (1 << found_bit)) ||
+              (store != NULL && store->Contains(hash)) ||
+              !library->Claim(hash)) {
+            LOG_VERBOSE(logger_, 1, "rejected download: " + ToString(hash));
             *found |= (1 << found_bit);
-            missing_hashes.pop_back();
-            continue;
           } else {
-            logger_->Verbose("accepted download: " + ToString(hash), 2);
+            LOG_VERBOSE(logger_, 2, "accepted download: " + ToString(hash));
+            claimed.insert(hash);
+            missing_hashes.push_back(hash);
+            local_copies.push_back(exif_delta_ ? exif_hasher.FindImage(
+                ExifHash(bytes + sizeof(ExifHash))) : NULL);
           }
-          found += (++found_bit % CHAR_BIT == 0);
+          found += ((found_bit = (found_bit + 1) % CHAR_BIT) == 0);
         }
         size_t found_bitmask_size = (hash_count + CHAR_BIT - 1) / CHAR_BIT;
         if (!SyncProtocol::WriteExactly(
                 sync_fd, found_bitmask, found_bitmask_size)) {
-          logger_->Fatal("cannot send download confirmation");
+          throw SyncError("cannot send download confirmation");
         }
         DEBUG_OUT_LN(SYNCRECV, "bitmask=%s | SENDING FOUND BITMASK",
                      DEBUG_HEX_STR(found_bitmask, found_bitmask_size));
 
+        // announce how much of each missing image is already staged (and
+        // of which file), or that only its EXIF is needed if we have the same
+        // image data
+        offsets.assign(missing_hashes.size() * kOffsetWords, 0);
+        for (size_t i = 0; i < missing_hashes.size(); ++i) {
+          size_t* words = &offsets[i * kOffsetWords];
+          if (local_copies[i] != NULL) {
+            words[0] = kExifOnlyOffset;
+            continue;
+          }
+          struct stat stat_buf;
+          const std::string& staged_path = ToPath(
+              download_dir, ToStagedName(missing_hashes[i]).c_str());
+          if (stat(staged_path.c_str(), &stat_buf) == 0 &&
+              getxattr(staged_path.c_str(), kSourceAttr, words + 1,
+                       kSourceWords * sizeof(size_t)) ==
+                  ssize_t(kSourceWords * sizeof(size_t))) {
+            words[0] = stat_buf.st_size;
+          }
+        }
+        if (!SyncProtocol::WriteFileSizes(sync_fd, offsets.data(),
+                                          offsets.size())) {
+          throw SyncError("cannot send download offsets");
+        }
+
         // download missing images
+        auto offset = offsets.begin();
+        auto local_copy = local_copies.begin();
         for (const auto& hash : missing_hashes) {
           // receive filename
           char filename[0xFF + 1];
           unsigned char filename_len;
           if (!SyncProtocol::ReadByte(sync_fd, &filename_len) ||
               !SyncProtocol::ReadExactly(sync_fd, filename, filename_len)){
-            logger_->Fatal("failed to receive filename for " + ToString(hash));
+            throw SyncError("failed to receive filename for " + ToString(hash));
           }
           filename[filename_len] = 0;
 #define IMG_STR ToImageStr(hash, filename)
 
-          // receive file size
+          // receive file size (or EXIF segment size, if only that is sent)
           size_t file_size;
           if (!SyncProtocol::ReadFileSize(sync_fd, &file_size))
-            logger_->Fatal("failed to receive size of " + IMG_STR);
-
-          // create file <filename> or <filename>-<sha1> (if former exists)
-          FstreamCloseGuard<decltype(ofs)> ofs_closer(&ofs);
-          std::string path = ToPath(download_dir, filename);
-          if (!ReopenEnd(path.c_str(), &ofs) &&
-              !ReopenEnd((path += ("-" + ToString(hash))).c_str(), &ofs)) {
-            logger_->Error("filename conflict resolution failed for " +
-                           IMG_STR);
-            // proceed with download without store, not to confuse the uploader
-            ReopenEnd(kDevNull, &ofs);
-          } else {
-            logger_->Verbose("downloading " + ToString(hash) + ": " + path);
+            throw SyncError("failed to receive size of " + IMG_STR);
+          job.tmp_name.clear();
+          size_t start = offset[0];
+          const size_t* staged_source = &offset[1];
+          offset += kOffsetWords;
+          auto local_entry = *local_copy++;
+          if (file_size == kMissingSize) {
+            logger_->Warn("peer failed to read " + IMG_STR);
+            unclaim(hash);
+            continue;
           }
-          ofs.seekp(0, ofs.beg);
 
-          // download the file
-          try {
-            DEBUG_OUT_LN(SYNCRECV, "hash=%s; size=%lu; name=%s | DOWNLOADING",
-                         DEBUG_STR(hash), (size_t)file_size, filename);
-            Download(sync_fd, file_size, &ofs);
+          if (start == kExifOnlyOffset && file_size) {
+            // splice the received EXIF segment into our copy of the image
+            try {
+              LOG_VERBOSE(logger_, 1, "downloading EXIF of " + IMG_STR +
+                          " into " + local_entry->path);
+              Download(sync_fd, file_size, &segment);
+              ReadFile(local_entry->path, &image);
+            } catch (const std::exception& e) {
+              logger_->Verbose(e.what());
+              throw SyncError("failed to download EXIF of " + IMG_STR);
+            }
+            if (!SpliceExifSegment(image, segment, &job.data)) {
+              logger_->Error("failed to splice EXIF of " + IMG_STR + " into " +
+                             local_entry->path);
+              unclaim(hash);
+              continue;
+            }
+          } else try {
+            // the uploader found no EXIF segment to send, so expect the file
+            if (start == kExifOnlyOffset &&
+                !SyncProtocol::ReadFileSize(sync_fd, &file_size)) {
+              throw SyncError("failed to receive size of " + IMG_STR);
+            }
+            size_t source[kSourceWords] = { file_size };
+            if (!SyncProtocol::ReadFileSizes(sync_fd, source + 1,
+                                             kSourceWords - 1)) {
+              throw SyncError("failed to receive time of " + IMG_STR);
+            }
+
+            // download the file, appending to the staged part of a large one
+            // so that an interrupted transfer can later resume from there
+            // (unless that part is of another version of the file)
+            if (start > file_size ||
+                !std::equal(source, source + kSourceWords, staged_source)) {
+              start = 0;
+            }
+            DEBUG_OUT_LN(SYNCRECV, "hash=%s; size=%lu; start=%lu; name=%s | "
+                         "DOWNLOADING", DEBUG_STR(hash), (size_t)file_size,
+                         start, filename);
+            if (start || file_size >= kStagingThreshold) {
+              if (start) {
+                LOG_VERBOSE(logger_, 1, "resuming download of " + IMG_STR +
+                            " at byte " + ToString(start));
+              }
+              job.tmp_name = ToStagedName(hash);
+              int fd;
+              sys_call_rv(fd, open,
+                          ToPath(download_dir, job.tmp_name.c_str()).c_str(),
+                          O_WRONLY | O_CREAT, 0666);
+              FD staged_fd = fd;
+              sys_call(ftruncate, staged_fd, start);
+              sys_call(lseek, staged_fd, start, SEEK_SET);
+              // without the version, the part is not resumed (but received)
+              fsetxattr(staged_fd, kSourceAttr, source, sizeof(source), 0);
+              Download(sync_fd, file_size - start, staged_fd);
+              fremovexattr(staged_fd, kSourceAttr);
+            } else {
+              Download(sync_fd, file_size, &job.data);
+            }
             DEBUG_OUT_LN(SYNCRECV, "hash=%s; size=%lu; name=%s | DOWNLOADED",
                          DEBUG_STR(hash), (size_t)file_size, filename);
           } catch (const std::exception& e) {
             logger_->Verbose(e.what());
-            logger_->Fatal("failed to download " + IMG_STR);
+            throw SyncError("failed to download " + IMG_STR);
           }
+
+          if (store != NULL) {
+            // store it as ab/cd/<sha1>.jpg, remembering the original name
+            job.name = store->Prepare(hash);
+            store->AddName(hash, filename);
+          } else {
+            // store it as <filename> or <filename>-<sha1> (if former exists)
+            job.name = filename;
+            if (name_index.Reserve(job.name)) {
+              // falls back to that if the file is created before it is stored
+              job.alt_name = job.name + "-" + ToString(hash);
+            } else if (!name_index.Reserve(job.name += "-" +
+                                           ToString(hash))) {
+              logger_->Error("filename conflict resolution failed for " +
+                             IMG_STR);
+              unclaim(hash);
+              continue;
+            }
+          }
+          LOG_VERBOSE(logger_, 1, "downloaded " + ToString(hash) + ": " +
+                      ToPath(download_dir, job.name.c_str()));
+          received.push_back(std::make_pair(hash, job.name));
+          writer_pool.Submit(&job);
 #undef IMG_STR
         }
+
+        // while watching, store the images as soon as the peer pauses
+        if (watch_ && !received.empty() && !IsReadable(sync_fd))
+          add_received();
       }
+      add_received();
+      peer_done = true;
       logger_->Verbose("finished downloading");
-    });
+    }));
 
-  std::thread uploader([&] {
-      FD sync_fd = upload_fd;
+  std::thread uploader(guarded([&] {
+      int sync_fd = upload_sock;
       DEBUG_OUT_LN(SYNCSEND, "fd=%2d | INIT SYNC DONE", (int)sync_fd);
 
       bool updated = false;
       std::mutex updated_mutex;
 
-      std::unordered_set<ExifHash> received_hashes;
+      // the hashes received in the update, only looked up once it is done
+      std::vector<ExifHash> received_list;
+      FrozenHashSet received_hashes;
       std::thread update_receiver([&] {
           logger_->Verbose("receiving update ...", 2);
           while (true) {
             unsigned char buf[UpdateProtocol::
                               hashes_per_packet * sizeof(ExifHash)];
-            ssize_t read_count = UpdateProtocol::
-                ReadFully(update_fd, buf, sizeof(buf));
+            ssize_t read_count;
+            try {
+              read_count = UpdateProtocol::
+                  ReadFully(update_fd, buf, sizeof(buf));
+            } catch (const SysCallException& e) {
+              // the peer resets the connection if it quits before reading
+              // the rest of our update, which it no longer needs
+              logger_->Verbose(e.what(), 2);
+              break;
+            }
             if (!read_count) {
               logger_->Verbose("received end of update");
               break;
@@ -273,10 +774,8 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
                             ToString(read_count));
               continue;
             }
-            if (logger_->verbosity() >= 2) { // prune slow path
-              logger_->Verbose("received update chunk of size " +
-                             ToString(read_count / sizeof(ExifHash)), 2);
-            }
+            LOG_VERBOSE(logger_, 2, "received update chunk of size " +
+                        ToString(read_count / sizeof(ExifHash)));
 
             std::unique_lock<std::mutex> locker(updated_mutex);
             if (updated)
@@ -284,14 +783,15 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
 
             DEBUG_OUT_LN(UPDRECV, "update=%s | RECEIVED",
                          DEBUG_HEX_STR(buf, read_count));
-            auto bytes = buf + read_count;
-            do {
-              bytes -= sizeof(ExifHash);
-              // received_hashes.emplace(bytes); // not supported on GCC 4.6.3
-              received_hashes.insert(bytes);
-            } while (bytes != buf);
-
-            if (logger_->verbosity() > 1) {
+            for (auto bytes = buf; bytes != buf + read_count;
+                 bytes += sizeof(ExifHash)) {
+              if (bounded)
+                peer_hashes->Insert(ExifHash(bytes));
+              else
+                received_list.push_back(ExifHash(bytes));
+            }
+
+            if (LOG_ENABLED(logger_, 2)) {
               auto bytes = buf + read_count;
               do {
                 ExifHash eh(bytes -= sizeof(ExifHash));
@@ -302,14 +802,24 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
           logger_->Verbose("stopped receiving hashes", 3);
           DEBUG_OUT_LN(UPDRECV, "DONE");
         });
-      update_receiver.detach();
+
+      // stop receiving the update on exit (even in case of exception)
+      auto on_exit = [&] {
+        shutdown(update_fd, SHUT_RD);
+        update_receiver.join();
+      };
+      struct ScopeExit {
+        ScopeExit(decltype(on_exit) f) : f(f) {}
+        ~ScopeExit() { f(); }
+        decltype(on_exit) f;
+      } scope_exit(on_exit);
 
       // wait until the sender notifies that it has sent all hashes
       DEBUG_OUT_LN(SYNCSEND, "WAITING UNTIL UPDATE RECEIVED");
       char byte;
       ssize_t read_count;
       if (!SyncProtocol::ReadByte(sync_fd, &byte)) {
-        logger_->Fatal("update failed: no response from update sender");
+        throw SyncError("update failed: no response from update sender");
       }
 
       // mark the end of update
@@ -319,69 +829,184 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
         updated = true;
       }
 
-      logger_->Verbose("received update of size " +
-                       ToString(received_hashes.size()));
+      // in sorted mode, merge the update with the own manifest instead,
+      // marking which of the (ordered) entries the peer has
+      std::vector<bool> in_update;
+      if (bounded) {
+        peer_hashes->Freeze();
+        logger_->Verbose("received update of size " +
+                         ToString(peer_hashes->size()) + " (spilled " +
+                         ToString(peer_hashes->spill_count()) + " times)");
+      } else if (sorted_update_ && mesh_ == NULL) {
+        // datagrams may arrive out of order, so check the update is sorted
+        if (!IsManifest(received_list.data(), received_list.size()))
+          SortManifest(&received_list);
+        logger_->Verbose("received update of size " +
+                         ToString(received_list.size()));
+
+        // wait until all own images are hashed, then sort them (by index)
+        {
+          std::unique_lock<std::mutex> locker(hasher_progress_mutex);
+          while (hashing)
+            hasher_progress.wait(locker);
+        }
+        size_t entry_count = hasher_entry_count.load();
+        std::vector<ExifHash> own_list;
+        own_list.reserve(entry_count);
+        auto entry = exif_hasher.before_first_entry();
+        while (own_list.size() != entry_count)
+          own_list.push_back((entry = entry->next)->hash);
+        std::vector<size_t> order(entry_count);
+        for (size_t i = 0; i < entry_count; ++i)
+          order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+            return own_list[lhs] < own_list[rhs];
+          });
+        std::vector<ExifHash> own_manifest;
+        own_manifest.reserve(entry_count);
+        for (auto i : order)
+          own_manifest.push_back(own_list[i]);
+        std::vector<ExifHash>().swap(own_list);
+
+        std::vector<size_t> own_only, peer_only;
+        DiffManifests(own_manifest.data(), own_manifest.size(),
+                      received_list.data(), received_list.size(),
+                      &own_only, &peer_only);
+        in_update.assign(entry_count, true);
+        for (auto i : own_only)
+          in_update[order[i]] = false;
+        logger_->Verbose("update differs in " + ToString(own_only.size()) +
+                         " own and " + ToString(peer_only.size()) +
+                         " peer images");
+      } else {
+        FrozenHashSet(&received_list).swap(received_hashes);
+        logger_->Verbose("received update of size " +
+                         ToString(received_hashes.size()));
+      }
+
+      // in a mesh, learn what all members have to know what to send
+      if (mesh_ != NULL) {
+        mesh_->SetHashes(peer_rank_, &received_hashes);
+        mesh_updated = true;
+        mesh_->Wait();
+      }
 
       logger_->Verbose("started uploading");
-      std::ifstream ifs;
+      Prefetcher prefetcher(kPrefetchDepth);
       unsigned char buf[SyncProtocol::hashes_per_packet * sizeof(ExifHash)];
       unsigned char found_bitmask[
           (SyncProtocol::hashes_per_packet + CHAR_BIT - 1) / CHAR_BIT];
 
       size_t processed_entry_count = 0;
       auto latest_entry = exif_hasher.before_first_entry();
-      std::vector<decltype(latest_entry)> missing_entries;
+      // whether the next entries are in the update, looked up ahead at once
+      // (with memory bounded, read back from the spool as well)
+      bool lookup = mesh_ == NULL && (!sorted_update_ || bounded);
+      const ExifHash* lookup_hashes[FrozenHashSet::kMaxBatch];
+      bool lookup_found[FrozenHashSet::kMaxBatch];
+      size_t lookup_count = 0, lookup_ind = 0;
+      std::vector<decltype(latest_entry)> missing_entries, accepted_entries;
+      std::vector<size_t> offsets;
+      std::string filename;
       while (true) {
         // wait until new hasher entries are found or hashing is done
         size_t total_entry_count = hasher_entry_count.load();
         if (processed_entry_count == total_entry_count) {
           std::unique_lock<std::mutex> locker(hasher_progress_mutex);
-          if (!hashing) // hasher is done
+          if (hashing) {
+            DEBUG_OUT_LN(SYNCSEND, "WAIT FOR HASHER");
+            hasher_progress.wait(locker);
+            continue;
+          }
+          locker.unlock();
+
+          // hasher is done, but while watching, follow the images added
+          // since (e.g. completed in the root) until the peer quits
+          if (!watch_ || peer_done)
             break;
-          DEBUG_OUT_LN(SYNCSEND, "WAIT FOR HASHER");
-          hasher_progress.wait(locker);
+          hasher_entry_count = exif_hasher.WaitFor(total_entry_count,
+                                                   kWatchPollInterval);
           continue;
         }
+        if (bounded)
+          entry_spool->Release();
 
         // figure out hash_count hashes that might be missing on the receiver,
         // picking at most SyncProtocol::hash_per_packet of them
         missing_entries.clear();
         auto bytes = buf;
         do {
+          if (lookup && lookup_ind == lookup_count) {
+            lookup_count = std::min(FrozenHashSet::kMaxBatch,
+                                    total_entry_count - processed_entry_count);
+            if (bounded)
+              latest_entry = entry_spool->Read(lookup_count);
+            auto entry = latest_entry;
+            for (size_t i = 0; i < lookup_count; ++i)
+              lookup_hashes[i] = &(entry = entry->next)->hash;
+            if (bounded) {
+              peer_hashes->ContainsBatch(lookup_hashes, lookup_count,
+                                         lookup_found);
+            } else {
+              received_hashes.ContainsBatch(lookup_hashes, lookup_count,
+                                            lookup_found);
+            }
+            lookup_ind = 0;
+          }
           latest_entry = latest_entry->next;
-          const auto& hash = *latest_entry->hash;
-          if (received_hashes.count(hash)) {
-            logger_->Verbose("skipping upload of " + ToString(hash), 2);
+          const auto& hash = latest_entry->hash;
+          bool received = false;
+          if (lookup) {
+            received = lookup_found[lookup_ind++];
+          } else if (mesh_ == NULL) {
+            // entries added since the merge (while watching) are searched
+            received = processed_entry_count < in_update.size() ?
+                in_update[processed_entry_count] :
+                std::binary_search(received_list.begin(), received_list.end(),
+                                   hash);
+          }
+          bool downloaded;
+          {
+            std::lock_guard<std::mutex> locker(downloaded_mutex);
+            downloaded = downloaded_hashes.count(hash);
+          }
+          if (received || downloaded || latest_entry->removed ||
+              (mesh_ != NULL && !mesh_->Offers(hash, peer_rank_))) {
+            LOG_VERBOSE(logger_, 2, "skipping upload of " + ToString(hash));
             continue;
           }
           hash.ToDigest(bytes);
           bytes += sizeof(ExifHash);
+          if (exif_delta_) {
+            latest_entry->image_hash.ToDigest(bytes);
+            bytes += sizeof(ExifHash);
+          }
           missing_entries.push_back(latest_entry);
         } while (++processed_entry_count != total_entry_count &&
-                 missing_entries.size() < SyncProtocol::hashes_per_packet);
+                 missing_entries.size() < offer_capacity);
 
         DEBUG_OUT_LN(SYNCSEND, "missing=%lu; total=%lu | DETERMINE",
-                     missing_entries.size(), (bytes - buf) / sizeof(ExifHash));
+                     missing_entries.size(), (bytes - buf) / offer_entry_size);
 
         // if all of them confirmed by receiver (in update), nothing to offer
         if (missing_entries.empty())
           continue;
 
-        if (logger_->verbosity() > 1) {
+        if (LOG_ENABLED(logger_, 2)) {
           logger_->Verbose("sending offer of size " +
                            ToString(missing_entries.size()), 2);
           for (auto e : missing_entries)
-            logger_->Verbose("offering " + ToString(*e->hash), 2);
+            logger_->Verbose("offering " + ToString(e->hash), 2);
         }
 
         // send an offer to upload hash_count hashes
         size_t hash_count = missing_entries.size();
         DEBUG_OUT_LN(SYNCSEND, "offer=%s | OFFERING",
-                     DEBUG_HEX_STR(buf, hash_count * sizeof(ExifHash)));
+                     DEBUG_HEX_STR(buf, hash_count * offer_entry_size));
         if (!SyncProtocol::WriteByte(sync_fd, hash_count) ||
             !SyncProtocol::WriteExactly(sync_fd, buf,
-                                        hash_count * sizeof(ExifHash))) {
-          logger_->Fatal("failed to send upload offer of size: " +
+                                        hash_count * offer_entry_size)) {
+          throw SyncError("failed to send upload offer of size: " +
                          ToString(hash_count));
         }
 
@@ -389,73 +1014,169 @@ void Peer::Sync(PathGenerator path_gen, const std::string& download_dir) {
         size_t found_bitmask_size = (hash_count + CHAR_BIT - 1) / CHAR_BIT;
         if (!SyncProtocol::ReadExactly(sync_fd, found_bitmask,
                                        found_bitmask_size)) {
-          logger_->Fatal("failed to receive offer confirmation");
+          throw SyncError("failed to receive offer confirmation");
         }
         DEBUG_OUT_LN(SYNCSEND, "bitmask=%s | RECEIVED FOUND BITMASK",
                      DEBUG_HEX_STR(found_bitmask, found_bitmask_size));
 
+        // start reading the accepted files ahead of sending them
+        accepted_entries.clear();
         auto found = found_bitmask;
         int found_bit = 0;
         for (auto entry : missing_entries) {
-#define IMG_STR ToImageStr(*entry->hash, entry->path)
           if (!(*found & (1 << found_bit))) {
-            const char* filename = ToFilename(entry->path);
-            auto filename_len = static_cast<unsigned char>(strlen(filename));
-            if (!SyncProtocol::WriteByte(sync_fd, filename_len) ||
-                !SyncProtocol::WriteExactly(sync_fd, filename, filename_len)) {
-              logger_->Fatal("failed to send filename of " + IMG_STR);
-            }
+            accepted_entries.push_back(entry);
+            prefetcher.Push(entry->path);
+          }
+          found += ((found_bit = (found_bit + 1) % CHAR_BIT) == 0);
+        }
 
-            // open the file to download and send its size
-            FstreamCloseGuard<decltype(ifs)> ifs_closer(&ifs);
-            if (!ReopenEnd(entry->path.c_str(), &ifs)) {
-              logger_->Fatal("failed to open " + IMG_STR);
-            }
-            size_t file_size = static_cast<size_t>(ifs.tellg());
-            if (!SyncProtocol::WriteFileSize(sync_fd, file_size)) {
-              logger_->Fatal("failed to send size of " + IMG_STR);
+        // receive how much of each accepted image the receiver already has
+        // (and of which version of the file)
+        offsets.resize(accepted_entries.size() * kOffsetWords);
+        if (!SyncProtocol::ReadFileSizes(sync_fd, offsets.data(),
+                                         offsets.size())) {
+          throw SyncError("failed to receive upload offsets");
+        }
+
+        auto offset = offsets.begin();
+        for (auto entry : accepted_entries) {
+#define IMG_STR ToImageStr(entry->hash, entry->path)
+          // send the original name of a stored image, if known
+          filename = ToFilename(entry->path);
+          if (store != NULL)
+            store->FindName(entry->hash, &filename);
+          auto filename_len = static_cast<unsigned char>(filename.size());
+          if (!SyncProtocol::WriteByte(sync_fd, filename_len) ||
+              !SyncProtocol::WriteExactly(sync_fd, filename.data(),
+                                          filename_len)) {
+            throw SyncError("failed to send filename of " + IMG_STR);
+          }
+
+          // take the (prefetched) file to upload and send its size, or
+          // that it is missing (if it was removed since it was hashed)
+          size_t file_size;
+          size_t start = offset[0];
+          const size_t* staged_source = &offset[1];
+          offset += kOffsetWords;
+          int file_fd = prefetcher.Pop(&file_size);
+          if (file_fd == -1) {
+            logger_->Warn("failed to open " + IMG_STR);
+            if (!SyncProtocol::WriteFileSize(sync_fd, kMissingSize))
+              throw SyncError("failed to send size of " + IMG_STR);
+            continue;
+          }
+          FD fd = file_fd;
+          try {
+            // send only the EXIF segment if the receiver has the image data
+            if (start == kExifOnlyOffset) {
+              LOG_VERBOSE(logger_, 1, "uploading EXIF of " +
+                          ToString(entry->hash) + ": " + entry->path);
+              if (UploadExif(sync_fd, fd, file_size))
+                continue;
+              start = 0;
             }
-            ifs.seekg(0, ifs.beg);
+          } catch (const std::exception& e) {
+            logger_->Verbose(e.what());
+            throw SyncError("failed to upload EXIF of " + IMG_STR);
+          }
+          size_t source[kSourceWords];
+          ToSource(fd, file_size, source);
+          if (!SyncProtocol::WriteFileSizes(sync_fd, source, kSourceWords)) {
+            throw SyncError("failed to send size of " + IMG_STR);
+          }
 
-            // upload the file
-            try {
-              logger_->Verbose("uploading " + ToString(*entry->hash) +
-                               ": " + entry->path);
-              DEBUG_OUT_LN(SYNCSEND, "hash=%s; size=%lu; path=%s | UPLOADING",
-                           DEBUG_STR(*entry->hash), file_size,
-                           entry->path.c_str());
-              Upload(sync_fd, file_size, &ifs);
-              DEBUG_OUT_LN(SYNCSEND, "hash=%s; size=%lu; path=%s | UPLOADED",
-                           DEBUG_STR(*entry->hash), file_size,
-                           entry->path.c_str());
-            } catch (const std::exception& e) {
-              logger_->Verbose(e.what());
-              logger_->Fatal("failed to upload " + IMG_STR);
+          // upload the file
+          try {
+            LOG_VERBOSE(logger_, 1, "uploading " + ToString(entry->hash) +
+                        ": " + entry->path);
+            DEBUG_OUT_LN(SYNCSEND, "hash=%s; size=%lu; path=%s | UPLOADING",
+                         DEBUG_STR(entry->hash), file_size,
+                         entry->path.c_str());
+            if (start > file_size ||
+                !std::equal(source, source + kSourceWords, staged_source)) {
+              start = 0;
             }
+            if (start) {
+              LOG_VERBOSE(logger_, 1, "resuming upload of " + IMG_STR +
+                          " at byte " + ToString(start));
+            }
+            Upload(sync_fd, file_size, fd, start);
+            DEBUG_OUT_LN(SYNCSEND, "hash=%s; size=%lu; path=%s | UPLOADED",
+                         DEBUG_STR(entry->hash), file_size,
+                         entry->path.c_str());
+          } catch (const std::exception& e) {
+            logger_->Verbose(e.what());
+            throw SyncError("failed to upload " + IMG_STR);
           }
-          found += (++found_bit % CHAR_BIT == 0);
 #undef IMG_STR
         }
       } // while (true)
 
       logger_->Verbose("finished uploading");
-    });
+
+      // let the peer's downloader finish
+      shutdown(sync_fd, SHUT_WR);
+    }));
 
   downloader.join();
   uploader.join();
+  if (!error.empty())
+    throw SyncError(error);
 }
 
-void Peer::Download(int sync_fd, size_t file_size, std::ofstream* ofs) {
-  std::vector<char> file(file_size);
-  if (!SyncProtocol::ReadExactly(sync_fd, file.data(), file_size))
+void Peer::Download(int sync_fd, size_t file_size, std::vector<char>* file) {
+  file->resize(file_size);
+  if (!SyncProtocol::ReadExactly(sync_fd, file->data(), file_size))
     throw std::runtime_error("failed to receive image");
-  ofs->write(file.data(), file_size);
 }
 
-void Peer::Upload(int sync_fd, size_t file_size, std::ifstream* ifs) {
-  std::vector<char> file(file_size);
-  ifs->read(file.data(), file_size);
-  if (!SyncProtocol::WriteExactly(sync_fd, file.data(), file_size)) {
-    throw std::runtime_error("failed to send image");
+void Peer::Download(int sync_fd, size_t file_size, int fd) {
+  std::vector<char> chunk(std::min(file_size, kChunkSize));
+  while (file_size) {
+    size_t chunk_size = std::min(file_size, chunk.size());
+    if (!SyncProtocol::ReadExactly(sync_fd, chunk.data(), chunk_size))
+      throw std::runtime_error("failed to receive image");
+    for (size_t offset = 0; offset < chunk_size; ) {
+      ssize_t write_count;
+      sys_call_rv(write_count, write, fd, chunk.data() + offset,
+                  chunk_size - offset);
+      offset += write_count;
+    }
+    file_size -= chunk_size;
+  }
+}
+
+// Sends the size and bytes of the file's EXIF segment, or just a zero size
+// (returning false) if it has none, in which case the whole file must follow.
+bool Peer::UploadExif(int sync_fd, int fd, size_t file_size) {
+  size_t begin = 0, end = 0;
+  void* map = MAP_FAILED;
+  if (file_size) {
+    sys_call2_rv(MAP_FAILED, map, mmap, NULL, file_size, PROT_READ,
+                 MAP_PRIVATE, fd, 0);
+  }
+  bool found = (map != MAP_FAILED &&
+                FindExifSegment(static_cast<const unsigned char*>(map),
+                                file_size, &begin, &end));
+  bool sent = (SyncProtocol::WriteFileSize(sync_fd, end - begin) &&
+               SyncProtocol::WriteExactly(sync_fd,
+                                          static_cast<char*>(map) + begin,
+                                          end - begin));
+  if (map != MAP_FAILED)
+    munmap(map, file_size);
+  if (!sent)
+    throw std::runtime_error("failed to send EXIF segment");
+  return found;
+}
+
+void Peer::Upload(int sync_fd, size_t file_size, int fd, size_t start) {
+  off_t offset = start;
+  for (file_size -= start; file_size; ) {
+    ssize_t write_count;
+    sys_call_rv(write_count, sendfile, sync_fd, fd, &offset, file_size);
+    if (!write_count)
+      throw std::runtime_error("failed to send image");
+    file_size -= write_count;
   }
 }
@@ -4,11 +4,19 @@
 #include <cstdint>
 
 #include <functional>
-#include <iosfwd>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
-class ExifHash;
+class Library;
 class Logger;
+class Mesh;
+
+// Failure of a sync session, which leaves other sessions unaffected.
+class SyncError : public std::runtime_error {
+ public:
+  explicit SyncError(const std::string& what) : std::runtime_error(what) {}
+};
 
 class Peer {
  public:
@@ -17,14 +25,32 @@ class Peer {
   Peer(Logger* logger);
   virtual ~Peer();
   void Sync(PathGenerator path_gen, const std::string& download_dir);
+  void Sync(Library* library);
+  void set_sharded(bool sharded);
+  void set_exif_delta(bool exif_delta);
+  void set_content_hash(bool content_hash);
+  void set_sorted_update(bool sorted_update);
+  void set_memory_budget(size_t memory_budget);
+  void set_mesh(Mesh* mesh);
+  void set_watch(bool watch);
 
  protected:
   virtual void InitUpdateConnection(int* update_fd) = 0;
   virtual bool InitSyncConnection(int* sync_fd, bool download);
-  void Download(int sync_fd, size_t file_size, std::ofstream* ofs);
-  void Upload(int sync_fd, size_t file_size, std::ifstream* ifs);
+  void Download(int sync_fd, size_t file_size, std::vector<char>* file);
+  void Download(int sync_fd, size_t file_size, int fd);
+  void Upload(int sync_fd, size_t file_size, int fd, size_t start = 0);
+  bool UploadExif(int sync_fd, int fd, size_t file_size);
 
   Logger* logger_;
+  bool sharded_;
+  bool exif_delta_;
+  bool content_hash_;
+  bool sorted_update_;
+  size_t memory_budget_; // in bytes, or 0 if unbounded
+  Mesh* mesh_;
+  size_t peer_rank_;
+  bool watch_;
 };
 
 #endif // PEER_HPP_
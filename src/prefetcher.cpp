@@ -0,0 +1,68 @@
+#include "prefetcher.hpp"
+
+#include "debug.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+Prefetcher::File::File(const std::string& path)
+    : path(path),
+      fd(-1),
+      size(0) {}
+
+Prefetcher::Prefetcher(size_t depth)
+    : depth_(depth),
+      open_count_(0) {}
+
+Prefetcher::~Prefetcher() {
+  for (auto it = files_.begin(); open_count_; ++it, --open_count_) {
+    if (it->fd != -1)
+      close(it->fd);
+  }
+}
+
+void Prefetcher::Push(const std::string& path) {
+  files_.emplace_back(path);
+  Fill();
+}
+
+// Returns the descriptor of the oldest pushed file (owned by the caller) and
+// sets its size, or returns -1 (with errno set) if it could not be opened.
+int Prefetcher::Pop(size_t* file_size) {
+  Fill();
+  const File& file = files_.front();
+  int fd = file.fd;
+  *file_size = file.size;
+  DEBUG_OUT_LN(PREFETCH, "fd=%2d; size=%lu; path=%s | POP", fd, file.size,
+               file.path.c_str());
+  files_.pop_front();
+  --open_count_;
+  Fill();
+  return fd;
+}
+
+bool Prefetcher::empty() const { return files_.empty(); }
+
+void Prefetcher::Fill() {
+  for (; open_count_ < depth_ && open_count_ < files_.size(); ++open_count_) {
+    File& file = files_[open_count_];
+    if ((file.fd = open(file.path.c_str(), O_RDONLY)) == -1)
+      continue;
+
+    struct stat stat_buf;
+    if (fstat(file.fd, &stat_buf) == -1) {
+      close(file.fd);
+      file.fd = -1;
+      continue;
+    }
+    file.size = static_cast<size_t>(stat_buf.st_size);
+
+    // start reading asynchronously; errors are harmless (only a hint)
+    posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(file.fd, 0, stat_buf.st_size, POSIX_FADV_WILLNEED);
+    DEBUG_OUT_LN(PREFETCH, "fd=%2d; size=%lu; path=%s | WILLNEED", file.fd,
+                 file.size, file.path.c_str());
+  }
+}
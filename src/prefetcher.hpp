@@ -0,0 +1,36 @@
+#ifndef PREFETCHER_HPP_
+#define PREFETCHER_HPP_
+
+#include <cstddef>
+
+#include <deque>
+#include <string>
+
+// Keeps up to depth queued files open ahead of the consumer, with the kernel
+// advised to read them in, so that the disk works while the socket drains.
+class Prefetcher {
+ public:
+  Prefetcher(size_t depth);
+  ~Prefetcher();
+
+  void Push(const std::string& path);
+  int Pop(size_t* file_size);
+  bool empty() const;
+
+ private:
+  struct File {
+    File(const std::string& path);
+
+    std::string path;
+    int fd;
+    size_t size;
+  };
+
+  void Fill();
+
+  size_t depth_;
+  size_t open_count_;
+  std::deque<File> files_;
+};
+
+#endif // PREFETCHER_HPP_
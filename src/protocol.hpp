@@ -9,6 +9,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <vector>
+
 #define SYNC_PROTO SOCK_STREAM
 
 #ifndef RELIABLE_UPDATE
@@ -86,6 +88,21 @@ struct Protocol {
     return WriteExactly(fd, &buf, sizeof(buf));
   }
 
+  static bool ReadFileSizes(int fd, size_t* file_sizes, size_t count) {
+    std::vector<uint32_t> buf(count);
+    bool ret = ReadExactly(fd, buf.data(), count * sizeof(uint32_t));
+    for (size_t i = 0; i < count; ++i)
+      file_sizes[i] = static_cast<size_t>(ntohl(buf[i]));
+    return ret;
+  }
+
+  static bool WriteFileSizes(int fd, const size_t* file_sizes, size_t count) {
+    std::vector<uint32_t> buf(count);
+    for (size_t i = 0; i < count; ++i)
+      buf[i] = htonl(static_cast<uint32_t>(file_sizes[i]));
+    return WriteExactly(fd, buf.data(), count * sizeof(uint32_t));
+  }
+
   static int protocol;
   static size_t hashes_per_packet;
 
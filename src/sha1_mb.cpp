@@ -0,0 +1,210 @@
+#include "sha1_mb.hpp"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+const size_t kBlockSize = 64;
+
+const uint32_t kInit[5] = {
+  0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+// The blocks of one buffer, the last one or two of which (holding the padding
+// and the length) are copied into tail.
+struct Lane {
+  const unsigned char* data;
+  size_t full_block_count;
+  size_t block_count;
+  unsigned char tail[2 * kBlockSize];
+
+  void Init(const unsigned char* data, size_t size) {
+    this->data = data;
+    full_block_count = size / kBlockSize;
+    size_t rest = size % kBlockSize;
+    block_count = full_block_count + 1 + (rest + 9 > kBlockSize);
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + full_block_count * kBlockSize, rest);
+    tail[rest] = 0x80;
+    uint64_t bit_count = static_cast<uint64_t>(size) * 8;
+    unsigned char* end = tail + (block_count - full_block_count) * kBlockSize;
+    for (int i = 1; i <= 8; ++i, bit_count >>= 8)
+      end[-i] = static_cast<unsigned char>(bit_count);
+  }
+
+  const unsigned char* Block(size_t i) const {
+    return (i < full_block_count ? data + i * kBlockSize :
+            tail + (std::min(i, block_count - 1) - full_block_count) *
+            kBlockSize);
+  }
+};
+
+#define ROTL(x, n) \
+  _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+// Loads 8 big endian words at the offset of each block, transposed so that
+// word i of all lanes is in w[i].
+__attribute__((target("avx2")))
+inline void LoadWords(const unsigned char* const* blocks, size_t offset,
+                      __m256i* w) {
+  const __m256i bswap = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  __m256i r[8];
+  for (size_t l = 0; l < kSha1Lanes; ++l) {
+    r[l] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(blocks[l] + offset)), bswap);
+  }
+
+  // transpose the 8x8 matrix of words (rows are lanes)
+  __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+  __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+  __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+  __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+  __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+  __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+  __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+  __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+  __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+  __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+  __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+  __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+  w[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  w[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  w[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  w[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  w[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  w[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  w[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  w[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// Extends the message schedule (kept in a ring of 16 words) to word t.
+__attribute__((target("avx2")))
+inline __m256i Schedule(__m256i* w, int t) {
+  __m256i x = _mm256_xor_si256(
+      _mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+      _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+  return w[t & 15] = ROTL(x, 1);
+}
+
+#define ROUND(f, k)                                                     \
+  do {                                                                  \
+    __m256i tmp = _mm256_add_epi32(                                     \
+        _mm256_add_epi32(ROTL(a, 5), f),                                \
+        _mm256_add_epi32(_mm256_add_epi32(e, _mm256_set1_epi32(k)), wt)); \
+    e = d;                                                              \
+    d = c;                                                              \
+    c = ROTL(b, 30);                                                    \
+    b = a;                                                              \
+    a = tmp;                                                            \
+  } while (0)
+
+// Runs the compression function on a block of each lane, updating the state
+// of the lanes that have not hashed all their blocks yet.
+__attribute__((target("avx2")))
+void Compress(const Lane* lanes, size_t block, __m256i* state) {
+  const unsigned char* blocks[kSha1Lanes];
+  uint32_t active[kSha1Lanes];
+  for (size_t l = 0; l < kSha1Lanes; ++l) {
+    blocks[l] = lanes[l].Block(block);
+    active[l] = (block < lanes[l].block_count ? ~0U : 0);
+  }
+
+  __m256i w[16];
+  LoadWords(blocks, 0, w);
+  LoadWords(blocks, 32, w + 8);
+
+  __m256i a = state[0], b = state[1], c = state[2], d = state[3],
+      e = state[4];
+  int t = 0;
+  __m256i wt;
+  while (t < 20) {
+    wt = (t < 16 ? w[t] : Schedule(w, t));
+    ++t;
+    ROUND(_mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))),
+          0x5A827999);
+  }
+  while (t < 40) {
+    wt = (t < 16 ? w[t] : Schedule(w, t));
+    ++t;
+    ROUND(_mm256_xor_si256(_mm256_xor_si256(b, c), d), 0x6ED9EBA1);
+  }
+  while (t < 60) {
+    wt = (t < 16 ? w[t] : Schedule(w, t));
+    ++t;
+    ROUND(_mm256_or_si256(_mm256_and_si256(b, c),
+                          _mm256_and_si256(d, _mm256_or_si256(b, c))),
+          0x8F1BBCDC);
+  }
+  while (t < 80) {
+    wt = (t < 16 ? w[t] : Schedule(w, t));
+    ++t;
+    ROUND(_mm256_xor_si256(_mm256_xor_si256(b, c), d), 0xCA62C1D6);
+  }
+
+  __m256i mask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(active));
+  __m256i sums[5] = {a, b, c, d, e};
+  for (int i = 0; i < 5; ++i) {
+    state[i] = _mm256_blendv_epi8(state[i],
+                                  _mm256_add_epi32(state[i], sums[i]), mask);
+  }
+}
+
+#undef ROUND
+#undef ROTL
+
+// Hashes up to kSha1Lanes buffers, the lanes beyond count hashing nothing.
+__attribute__((target("avx2")))
+void HashLanes(const unsigned char* const* data, const size_t* sizes,
+               size_t count, unsigned char* const* digests) {
+  Lane lanes[kSha1Lanes];
+  size_t block_count = 0;
+  for (size_t l = 0; l < kSha1Lanes; ++l) {
+    if (l < count)
+      lanes[l].Init(data[l], sizes[l]);
+    else
+      lanes[l].Init(data[0], 0);
+    block_count = std::max(block_count, lanes[l].block_count);
+  }
+
+  __m256i state[5];
+  for (int i = 0; i < 5; ++i)
+    state[i] = _mm256_set1_epi32(kInit[i]);
+  for (size_t block = 0; block < block_count; ++block)
+    Compress(lanes, block, state);
+
+  uint32_t words[5][kSha1Lanes];
+  for (int i = 0; i < 5; ++i)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+  for (size_t l = 0; l < count; ++l) {
+    for (int i = 0; i < 5; ++i) {
+      uint32_t word = __builtin_bswap32(words[i][l]);
+      memcpy(digests[l] + 4 * i, &word, sizeof(word));
+    }
+  }
+}
+
+} // namespace
+
+bool HasSha1MultiBuffer() {
+  return __builtin_cpu_supports("avx2");
+}
+
+// Computes the SHA-1 digests of the buffers, kSha1Lanes of them at once
+// (which pays off for many small ones, like serialized EXIF). Must only be
+// called if HasSha1MultiBuffer.
+void Sha1MultiBuffer(const unsigned char* const* data, const size_t* sizes,
+                     size_t count, unsigned char* const* digests) {
+  for (size_t i = 0; i < count; i += kSha1Lanes) {
+    HashLanes(data + i, sizes + i, std::min(kSha1Lanes, count - i),
+              digests + i);
+  }
+}
@@ -0,0 +1,13 @@
+#ifndef SHA1_MB_HPP_
+#define SHA1_MB_HPP_
+
+#include <cstddef>
+
+// number of buffers hashed in parallel, one per 32-bit lane of an AVX2 vector
+const size_t kSha1Lanes = 8;
+
+bool HasSha1MultiBuffer();
+void Sha1MultiBuffer(const unsigned char* const* data, const size_t* sizes,
+                     size_t count, unsigned char* const* digests);
+
+#endif // SHA1_MB_HPP_
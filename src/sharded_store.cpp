@@ -0,0 +1,135 @@
+#include "sharded_store.hpp"
+
+#include "debug.hpp"
+#include "util/string_utils.hpp"
+#include "util/syscall.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fstream>
+
+namespace {
+
+const size_t kHashStrLen = 2 * sizeof(ExifHash);
+const size_t kShardCount = 0x10000;
+
+inline int FromHexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+bool ParseHash(const std::string& str, ExifHash* hash) {
+  unsigned char digest[sizeof(ExifHash)];
+  if (str.size() < kHashStrLen)
+    return false;
+  for (size_t i = 0; i < sizeof(digest); ++i) {
+    int hi = FromHexDigit(str[2 * i]), lo = FromHexDigit(str[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    digest[i] = (hi << 4) | lo;
+  }
+  *hash = ExifHash(digest);
+  return true;
+}
+
+void MakeDir(int dir_fd, const std::string& path) {
+  if (mkdirat(dir_fd, path.c_str(), 0777) == -1 && errno != EEXIST)
+    throw SysCallException(__FILE__, __LINE__, "mkdirat(" + path + ")");
+}
+
+} // namespace
+
+const char* const ShardedStore::kNamesFile = ".jpgsync-names";
+
+ShardedStore::ShardedStore(const std::string& dir)
+    : dir_(dir),
+      shards_(kShardCount) {
+  int fd;
+  sys_call_rv(fd, open, dir.c_str(), O_RDONLY | O_DIRECTORY);
+  dir_fd_ = fd;
+  LoadNames();
+  sys_call_rv(fd, openat, dir_fd_, kNamesFile,
+              O_WRONLY | O_CREAT | O_APPEND, 0666);
+  names_fd_ = fd;
+}
+
+std::string ShardedStore::ToPath(const ExifHash& hash) {
+  const std::string& hash_str = ToString(hash);
+  return hash_str.substr(0, 2) + '/' + hash_str.substr(2, 2) + '/' +
+      hash_str + ".jpg";
+}
+
+bool ShardedStore::Contains(const ExifHash& hash) const {
+  struct stat stat_buf;
+  return fstatat(dir_fd_, ToPath(hash).c_str(), &stat_buf,
+                 AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+// Creates the shard directories for the hash and returns its relative path.
+std::string ShardedStore::Prepare(const ExifHash& hash) {
+  const std::string& path = ToPath(hash);
+  size_t shard = (FromHexDigit(path[0]) << 12) | (FromHexDigit(path[1]) << 8) |
+      (FromHexDigit(path[3]) << 4) | FromHexDigit(path[4]);
+
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  if (!shards_[shard]) {
+    MakeDir(dir_fd_, path.substr(0, 2));
+    MakeDir(dir_fd_, path.substr(0, 5));
+    shards_[shard] = true;
+  }
+  return path;
+}
+
+// Hard links the image at path (relative to the working directory) into the
+// store, telling apart an image stored under the hash already: the same file
+// (by a cheap stat, as when linking again) or another one.
+ShardedStore::LinkResult ShardedStore::Link(const ExifHash& hash,
+                                            const std::string& path) {
+  const std::string& store_path = Prepare(hash);
+  struct stat stat_buf, store_stat_buf;
+  sys_call(stat, path.c_str(), &stat_buf);
+  if (fstatat(dir_fd_, store_path.c_str(), &store_stat_buf,
+              AT_SYMLINK_NOFOLLOW) == 0) {
+    return store_stat_buf.st_dev == stat_buf.st_dev &&
+        store_stat_buf.st_ino == stat_buf.st_ino ? kAlreadyLinked : kConflict;
+  }
+  if (linkat(AT_FDCWD, path.c_str(), dir_fd_, store_path.c_str(), 0) == -1) {
+    if (errno == EEXIST) // linked just now for an image with the same hash
+      return kConflict;
+    throw SysCallException(__FILE__, __LINE__, "linkat(" + path + ")");
+  }
+  return kLinked;
+}
+
+// Records the original name of the image in the sidecar file.
+void ShardedStore::AddName(const ExifHash& hash, const std::string& name) {
+  const std::string& line = ToString(hash) + "  " + name + '\n';
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  names_[hash] = name;
+  ssize_t write_count;
+  sys_call_rv(write_count, write, names_fd_, line.data(), line.size());
+}
+
+bool ShardedStore::FindName(const ExifHash& hash, std::string* name) const {
+  std::lock_guard<decltype(mutex_)> locker(mutex_);
+  auto it = names_.find(hash);
+  if (it == names_.end())
+    return false;
+  *name = it->second;
+  return true;
+}
+
+void ShardedStore::LoadNames() {
+  std::ifstream ifs(dir_ + '/' + kNamesFile);
+  ExifHash hash;
+  for (std::string line; std::getline(ifs, line); ) {
+    if (line.size() > kHashStrLen + 2 && ParseHash(line, &hash))
+      names_[hash] = line.substr(kHashStrLen + 2);
+  }
+  DEBUG_OUT_LN(STORE, "count=%lu | LOADED NAMES", names_.size());
+}
@@ -0,0 +1,41 @@
+#ifndef SHARDED_STORE_HPP_
+#define SHARDED_STORE_HPP_
+
+#include "exif_hash.hpp"
+#include "util/fd.hpp"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Content-addressed layout of a directory, in which images are stored as
+// ab/cd/<exif hash>.jpg and their original names are kept in a sidecar file.
+class ShardedStore {
+ public:
+  ShardedStore(const std::string& dir);
+
+  static std::string ToPath(const ExifHash& hash);
+
+  bool Contains(const ExifHash& hash) const;
+  std::string Prepare(const ExifHash& hash);
+  enum LinkResult { kLinked, kAlreadyLinked, kConflict };
+  LinkResult Link(const ExifHash& hash, const std::string& path);
+  void AddName(const ExifHash& hash, const std::string& name);
+  bool FindName(const ExifHash& hash, std::string* name) const;
+
+  static const char* const kNamesFile;
+
+ private:
+  void LoadNames();
+
+  std::string dir_;
+  FD dir_fd_;
+  FD names_fd_;
+
+  mutable std::mutex mutex_;
+  std::vector<bool> shards_;
+  std::unordered_map<ExifHash, std::string> names_;
+};
+
+#endif // SHARDED_STORE_HPP_
@@ -13,6 +13,7 @@
 #include <sys/socket.h>
 
 #include <exception>
+#include <random>
 #include <string>
 
 class AddrInfo {
@@ -78,7 +79,10 @@ class AddrInfo {
 Slave::Slave(Logger* logger)
     : Peer(logger),
       update_addr_info_(NULL),
-      sync_addr_info_(NULL) {}
+      sync_addr_info_(NULL) {
+  std::random_device random;
+  session_id_ = (static_cast<uint64_t>(random()) << 32) | random();
+}
 
 Slave::~Slave() {
   delete update_addr_info_;
@@ -97,14 +101,14 @@ void Slave::InitUpdateConnection(int* update_fd) {
                    ToString(update_addr_info_->port()));
   DEBUG_OUT_LN(INITUPD, "CONNECTING");
   if (!update_addr_info_->Connect(update_fd))
-    logger_->Fatal("Failed to establish update connection to master");
+    throw SyncError("Failed to establish update connection to master");
   DEBUG_OUT_LN(INITUPD, "CONNECTED");
 }
 
 bool Slave::InitSyncConnection(int* sync_fd, bool download) {
   DEBUG_OUT_LN(INITSYNC, "CONNECTING");
   if (!sync_addr_info_->Connect(sync_fd))
-    logger_->Fatal("Failed to establish sync connection to master");
+    throw SyncError("Failed to establish sync connection to master");
 #ifdef DEBUG
   sockaddr_in sin;
   socklen_t sin_len = sizeof(sin);
@@ -113,9 +117,13 @@ bool Slave::InitSyncConnection(int* sync_fd, bool download) {
                (int)ntohs(sin.sin_port));
 #endif
 
+  // tell the master which session the connection belongs to
+  if (!SyncProtocol::WriteExactly(*sync_fd, &session_id_, sizeof(session_id_)))
+    throw SyncError("Failed to send session id to master");
+
   uint16_t update_port;
   if (!SyncProtocol::ReadExactly(*sync_fd, &update_port, sizeof(update_port)))
-    logger_->Fatal("Failed to receive update port from master");
+    throw SyncError("Failed to receive update port from master");
   update_port = ntohs(update_port);
 
   DEBUG_OUT_LN(INITSYNC, "RESOLVING");
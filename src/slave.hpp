@@ -20,6 +20,7 @@ class Slave : public Peer {
  private:
   AddrInfo* update_addr_info_;
   AddrInfo* sync_addr_info_;
+  uint64_t session_id_;
 };
 
 #endif // SLAVE_HPP_
@@ -0,0 +1,227 @@
+#include "spilled_hash_set.hpp"
+
+#include "util/syscall.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+
+namespace {
+
+const size_t kFenceStride = 256;
+// number of hashes read from each run (and written) at a time when merging
+const size_t kMergeChunkSize = 4096;
+// number of hashes the buffer starts with, growing up to the budget
+const size_t kMinBuffered = 1024;
+
+void WriteFully(int fd, const void* data, size_t size) {
+  auto bytes = static_cast<const char*>(data);
+  for (size_t offset = 0; offset < size; ) {
+    ssize_t write_count;
+    sys_call_rv(write_count, write, fd, bytes + offset, size - offset);
+    offset += write_count;
+  }
+}
+
+void ReadFully(int fd, void* data, size_t size, off_t offset) {
+  auto bytes = static_cast<char*>(data);
+  for (size_t done = 0; done < size; ) {
+    ssize_t read_count;
+    sys_call_rv(read_count, pread, fd, bytes + done, size - done,
+                offset + done);
+    if (!read_count)
+      throw std::runtime_error("unexpected end of spilled hashes");
+    done += read_count;
+  }
+}
+
+// The hashes of a run, read a chunk at a time.
+struct RunReader {
+  RunReader(int fd, size_t size) : fd(fd), size(size), read_count(0) {
+    Fill();
+  }
+
+  bool empty() const { return ind == chunk.size(); }
+  const ExifHash& front() const { return chunk[ind]; }
+  void Pop() {
+    if (++ind == chunk.size())
+      Fill();
+  }
+
+  void Fill() {
+    chunk.resize(std::min(kMergeChunkSize, size - read_count));
+    ReadFully(fd, chunk.data(), chunk.size() * sizeof(ExifHash),
+              read_count * sizeof(ExifHash));
+    read_count += chunk.size();
+    ind = 0;
+  }
+
+  int fd;
+  size_t size;
+  size_t read_count;
+  std::vector<ExifHash> chunk;
+  size_t ind;
+};
+
+} // namespace
+
+int OpenSpillFile(const std::string& dir) {
+  int fd = open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+  if (fd != -1)
+    return fd;
+
+  // the filesystem cannot do anonymous files, so unlink a named one
+  std::string path = dir + "/.jpgsync-spill-XXXXXX";
+  sys_call_rv(fd, mkstemp, &path[0]);
+  unlink(path.c_str());
+  return fd;
+}
+
+// Spills to files in dir, keeping at most budget bytes of hashes in memory.
+SpilledHashSet::SpilledHashSet(const std::string& dir, size_t budget)
+    : dir_(dir),
+      max_buffered_(std::max<size_t>(budget / sizeof(ExifHash), 1)),
+      map_(NULL),
+      map_size_(0),
+      hashes_(NULL),
+      size_(0),
+      spill_count_(0) {}
+
+SpilledHashSet::~SpilledHashSet() {
+  for (const auto& run : runs_)
+    close(run.fd);
+  if (map_ != NULL)
+    munmap(map_, map_size_);
+}
+
+// Adds the hash (which may be in the set already), until the set is frozen.
+void SpilledHashSet::Insert(const ExifHash& hash) {
+  if (buffer_.size() == max_buffered_)
+    Spill();
+  if (buffer_.size() == buffer_.capacity()) {
+    buffer_.reserve(std::min(std::max(2 * buffer_.capacity(), kMinBuffered),
+                             max_buffered_));
+  }
+  buffer_.push_back(hash);
+}
+
+// Ends inserting, merging what was spilled, so that the set can be searched.
+void SpilledHashSet::Freeze() {
+  if (runs_.empty()) {
+    SortBuffer();
+    hashes_ = buffer_.data();
+    size_ = buffer_.size();
+    return;
+  }
+
+  if (!buffer_.empty())
+    Spill();
+  std::vector<ExifHash>().swap(buffer_);
+  Merge();
+  if (size_) {
+    map_size_ = size_ * sizeof(ExifHash);
+    sys_call2_rv(MAP_FAILED, map_, mmap, NULL, map_size_, PROT_READ,
+                 MAP_SHARED, merged_fd_, 0);
+    madvise(map_, map_size_, MADV_RANDOM);
+    hashes_ = static_cast<const ExifHash*>(map_);
+  }
+  for (size_t i = 0; i < size_; i += kFenceStride)
+    fences_.push_back(hashes_[i].prefix());
+}
+
+bool SpilledHashSet::Contains(const ExifHash& hash) const {
+  if (fences_.empty())
+    return std::binary_search(hashes_, hashes_ + size_, hash);
+
+  // hashes rarely share their leading bits, but those that do may span
+  // the stretches between fences
+  uint64_t prefix = hash.prefix();
+  size_t first = std::lower_bound(fences_.begin(), fences_.end(), prefix) -
+      fences_.begin();
+  size_t last = std::upper_bound(fences_.begin() + first, fences_.end(),
+                                 prefix) - fences_.begin();
+  first -= (first != 0);
+  return std::binary_search(hashes_ + first * kFenceStride,
+                            hashes_ + std::min(last * kFenceStride, size_),
+                            hash);
+}
+
+// Looks up the hashes, setting whether each is found (as FrozenHashSet).
+void SpilledHashSet::ContainsBatch(const ExifHash* const* hashes,
+                                   size_t count, bool* found) const {
+  for (size_t i = 0; i < count; ++i)
+    found[i] = Contains(*hashes[i]);
+}
+
+// Returns the hashes in ascending order, without repeats (once frozen).
+const ExifHash* SpilledHashSet::data() const { return hashes_; }
+size_t SpilledHashSet::size() const { return size_; }
+size_t SpilledHashSet::spill_count() const { return spill_count_; }
+
+void SpilledHashSet::SortBuffer() {
+  std::sort(buffer_.begin(), buffer_.end());
+  buffer_.erase(std::unique(buffer_.begin(), buffer_.end()), buffer_.end());
+}
+
+// Writes the hashes buffered out as a sorted run, and empties the buffer.
+void SpilledHashSet::Spill() {
+  SortBuffer();
+  Run run = {OpenSpillFile(dir_), buffer_.size()};
+  runs_.push_back(run);
+  ++spill_count_;
+  WriteFully(run.fd, buffer_.data(), buffer_.size() * sizeof(ExifHash));
+  buffer_.clear();
+}
+
+// Merges the runs into one file (dropping repeats), closing them.
+void SpilledHashSet::Merge() {
+  merged_fd_ = OpenSpillFile(dir_);
+  std::vector<RunReader> readers;
+  readers.reserve(runs_.size());
+  for (const auto& run : runs_)
+    readers.push_back(RunReader(run.fd, run.size));
+
+  auto greater = [&readers](size_t lhs, size_t rhs) {
+    return readers[rhs].front() < readers[lhs].front();
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(greater)>
+      heads(greater);
+  for (size_t i = 0; i < readers.size(); ++i) {
+    if (!readers[i].empty())
+      heads.push(i);
+  }
+
+  std::vector<ExifHash> chunk;
+  chunk.reserve(kMergeChunkSize);
+  ExifHash last;
+  size_ = 0;
+  while (!heads.empty()) {
+    auto& reader = readers[heads.top()];
+    heads.pop();
+    if (!size_ || reader.front() != last) {
+      chunk.push_back(last = reader.front());
+      ++size_;
+      if (chunk.size() == kMergeChunkSize) {
+        WriteFully(merged_fd_, chunk.data(),
+                   chunk.size() * sizeof(ExifHash));
+        chunk.clear();
+      }
+    }
+    reader.Pop();
+    if (!reader.empty())
+      heads.push(&reader - readers.data());
+  }
+  WriteFully(merged_fd_, chunk.data(), chunk.size() * sizeof(ExifHash));
+
+  for (const auto& run : runs_)
+    close(run.fd);
+  runs_.clear();
+}
@@ -0,0 +1,64 @@
+#ifndef SPILLED_HASH_SET_HPP_
+#define SPILLED_HASH_SET_HPP_
+
+#include "exif_hash.hpp"
+#include "util/fd.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+// Opens an anonymous file in dir for data spilled from memory.
+int OpenSpillFile(const std::string& dir);
+
+// A set of hashes kept within a memory budget: they are collected in memory
+// and written out as a sorted run whenever the budget is used up. Once all
+// are inserted, the runs are merged into one sorted file, which is mapped
+// and searched where it lies, through the leading bits of every 256th hash
+// (so that a lookup reads a page or two). A set that fits the budget stays
+// in memory.
+class SpilledHashSet {
+ public:
+  SpilledHashSet(const std::string& dir, size_t budget);
+  ~SpilledHashSet();
+
+  void Insert(const ExifHash& hash);
+  void Freeze();
+
+  bool Contains(const ExifHash& hash) const;
+  void ContainsBatch(const ExifHash* const* hashes, size_t count,
+                     bool* found) const;
+  const ExifHash* data() const;
+  size_t size() const;
+  size_t spill_count() const;
+
+ private:
+  SpilledHashSet(const SpilledHashSet&);
+  SpilledHashSet& operator=(const SpilledHashSet&);
+
+  struct Run {
+    int fd;
+    size_t size;
+  };
+
+  void SortBuffer();
+  void Spill();
+  void Merge();
+
+  std::string dir_;
+  size_t max_buffered_; // hashes
+  std::vector<ExifHash> buffer_;
+  std::vector<Run> runs_;
+
+  FD merged_fd_;
+  void* map_;
+  size_t map_size_;
+  const ExifHash* hashes_;
+  size_t size_;
+  std::vector<uint64_t> fences_; // prefixes of every kFenceStride-th hash
+  size_t spill_count_;
+};
+
+#endif // SPILLED_HASH_SET_HPP_
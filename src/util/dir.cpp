@@ -2,37 +2,72 @@
 
 #include "syscall.hpp"
 
+#include <algorithm>
 #include <cerrno>
 
-Dir::Dir(const std::string& path)
+Dir::Dir(const std::string& path, bool recursive, size_t window)
     : path_(path + '/'),
-      prefix_len_(path_.length()) {
-  sys_call2_rv(NULL, dir_, opendir, path.c_str());
+      recursive_(recursive),
+      window_(window),
+      entry_ind_(0) {
+  Level level = { NULL, path_.length() };
+  sys_call2_rv(NULL, level.dir, opendir, path.c_str());
+  levels_.push_back(level);
 }
 
 Dir::~Dir() {
-  sys_call(closedir, dir_);
+  for (auto it = levels_.rbegin(); it != levels_.rend(); ++it)
+    sys_call(closedir, it->dir);
 }
 
 const std::string& Dir::Next() {
-  do {
+  if (window_ <= 1)
+    return Read();
+
+  if (entry_ind_ == entries_.size()) {
+    entries_.clear();
+    entry_ind_ = 0;
+    while (entries_.size() < window_ && !Read().empty()) {
+      Entry entry = { entry_->d_ino, path_ };
+      entries_.push_back(entry);
+    }
+    if (entries_.empty())
+      return path_; // cleared by Read
+    std::sort(entries_.begin(), entries_.end(),
+              [](const Entry& a, const Entry& b) { return a.ino < b.ino; });
+  }
+  return entries_[entry_ind_++].path;
+}
+
+// Returns the next file in the order of the directory.
+const std::string& Dir::Read() {
+  while (!levels_.empty()) {
+    const Level& level = levels_.back();
     int saved_errno = (errno = 0);
-    entry_ = readdir(dir_);
+    entry_ = readdir(level.dir);
     if (errno != saved_errno)
       throw SysCallException(__FILE__, __LINE__, "readdir");
-    if (entry_ == NULL)
-      break;
+    if (entry_ == NULL) {
+      sys_call(closedir, level.dir);
+      levels_.pop_back();
+      continue;
+    }
 
-    // // skip current and parent directory
-    // const char* c = entry_->d_name;
-    // if (*c == '.' && (*++c == 0 || (*c == '.' && *++c == 0)))
-    //   continue;
+    path_.replace(level.prefix_len, std::string::npos, entry_->d_name);
 
-    // skip directories
-    if (entry_->d_type == DT_DIR)
+    // skip directories, unless descending into them (except hidden ones,
+    // which also covers the current and parent directory)
+    if (entry_->d_type == DT_DIR) {
+      if (recursive_ && entry_->d_name[0] != '.') {
+        path_ += '/';
+        Level sublevel = { NULL, path_.length() };
+        sys_call2_rv(NULL, sublevel.dir, opendir, path_.c_str());
+        levels_.push_back(sublevel);
+      }
       continue;
+    }
 
-    return path_.replace(prefix_len_, std::string::npos, entry_->d_name);
-  } while (true);
+    return path_;
+  }
   return path_.erase(0);
 }
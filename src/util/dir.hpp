@@ -5,18 +5,38 @@
 #include <dirent.h>
 
 #include <string>
+#include <vector>
 
+// Lists the files in a directory. With a window, that many entries are read
+// ahead and returned in inode order, which on most filesystems follows their
+// place on the disk much better than the (hash) order of the directory.
 class Dir {
  public:
-  Dir(const std::string& path);
+  Dir(const std::string& path, bool recursive = false, size_t window = 1);
   ~Dir();
 
   const std::string& Next();
  private:
+  struct Level {
+    DIR* dir;
+    size_t prefix_len;
+  };
+
+  struct Entry {
+    ino_t ino;
+    std::string path;
+  };
+
+  const std::string& Read();
+
   std::string path_;
-  size_t prefix_len_;
-  DIR* dir_;
+  std::vector<Level> levels_;
+  bool recursive_;
   dirent* entry_;
+
+  size_t window_;
+  std::vector<Entry> entries_;
+  size_t entry_ind_; // of the next one to return
 };
 
 #endif // UTIL_DIR_HPP_
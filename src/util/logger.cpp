@@ -1,21 +1,138 @@
 #include "logger.hpp"
 
 #include <cstdlib>
+#include <cstring>
 
-#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <vector>
 
 namespace {
 
 const std::string kFatalTag = "fatal";
 const std::string kErrorTag = "error";
 
+// how long the writing thread sleeps unless woken by a first new message
+const std::chrono::milliseconds kDrainInterval(100);
+
+std::atomic<uint64_t> gLoggerCount(0);
+
+} // namespace
+
+// Messages of one thread to one logger: a single-producer, single-consumer
+// ring of bytes holding each line after its size. The positions only grow,
+// so that they tell how much is in the ring.
+struct LogRing {
+  static const size_t kSize = 1 << 16;
+
+  explicit LogRing(uint64_t logger_id)
+      : logger_id(logger_id),
+        next(NULL),
+        head(0),
+        tail(0),
+        refs(2) {}
+
+  size_t free() const {
+    return kSize - (head.load(std::memory_order_relaxed) -
+                    tail.load(std::memory_order_acquire));
+  }
+
+  void CopyIn(size_t pos, const void* data, size_t size) {
+    size_t offset = pos % kSize, first = std::min(size, kSize - offset);
+    memcpy(bytes + offset, data, first);
+    memcpy(bytes, static_cast<const char*>(data) + first, size - first);
+  }
+
+  void CopyOut(size_t pos, void* data, size_t size) const {
+    size_t offset = pos % kSize, first = std::min(size, kSize - offset);
+    memcpy(data, bytes + offset, first);
+    memcpy(static_cast<char*>(data) + first, bytes, size - first);
+  }
+
+  // Drops a reference (of the thread or the logger), freeing the ring with
+  // the last one.
+  void Release() {
+    if (refs.fetch_sub(1) == 1)
+      delete this;
+  }
+
+  const uint64_t logger_id;
+  LogRing* next; // in the list of the logger, only changed when draining
+  std::atomic<size_t> head; // written up to, by the thread
+  std::atomic<size_t> tail; // read up to, by the writing thread
+  std::atomic<int> refs; // of the thread (until it exits) and the logger
+  char bytes[kSize];
+};
+
+namespace {
+
+// The rings of the thread, released when it exits.
+struct ThreadRings {
+  ~ThreadRings() {
+    for (auto ring : rings)
+      ring->Release();
+  }
+
+  std::vector<LogRing*> rings;
+};
+
+thread_local ThreadRings tThreadRings;
+
 } // namespace
 
 Logger::Logger(const std::string& name, unsigned verbosity, std::ostream* os)
     : name_(name),
       verbosity_(verbosity),
       os_(os),
-      exit_status_(0) {}
+      exit_status_(0),
+      id_(++gLoggerCount),
+      rings_(NULL),
+      pending_(false),
+      stopping_(false) {}
+
+Logger::~Logger() {
+  if (writer_.joinable()) {
+    {
+      std::lock_guard<std::mutex> locker(wake_mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    Drain();
+  }
+  for (auto ring = rings_.load(); ring != NULL; ) {
+    auto next = ring->next;
+    ring->Release();
+    ring = next;
+  }
+}
+
+// Leaves writing the messages to a thread of its own from now on, so that
+// logging does not wait for the stream (nor for other logging threads).
+// Messages of one thread stay in order, but not those of different ones.
+void Logger::WriteInBackground() {
+  if (writer_.joinable())
+    return;
+  writer_ = std::thread([this] {
+      std::unique_lock<std::mutex> locker(wake_mutex_);
+      while (!stopping_) {
+        wake_.wait_for(locker, kDrainInterval, [this] {
+            return stopping_ || pending_.load();
+          });
+        locker.unlock();
+        Drain();
+        locker.lock();
+      }
+    });
+}
+
+// Writes out the messages logged so far (by any thread).
+void Logger::Flush() {
+  if (writer_.joinable())
+    Drain();
+  else
+    os_->flush();
+}
 
 void Logger::Verbose(const std::string& msg, unsigned min_verbosity) {
   if (verbosity_ >= min_verbosity)
@@ -30,22 +147,107 @@ void Logger::Error(const std::string& msg) {
 
 void Logger::Fatal(const std::string& msg) {
   Write(kFatalTag, msg);
+  Flush();
   std::terminate();
 }
 
 void Logger::Write(const std::string& tag, const std::string& msg) {
-  static std::mutex mutex;
-  std::lock_guard<decltype(mutex)> locker(mutex);
-  if (!tag.empty()) {
-    if (tag == kFatalTag)
-      exit_status_ |= 1;
-    else if (tag == kErrorTag)
-      exit_status_ |= 2;
+  if (tag == kFatalTag)
+    exit_status_ |= 1;
+  else if (tag == kErrorTag)
+    exit_status_ |= 2;
+  if (writer_.joinable() && Enqueue(tag, msg))
+    return;
 
+  // (the writing thread writes to the stream under drain_mutex_)
+  static std::mutex mutex;
+  std::lock_guard<decltype(mutex)> locker(writer_.joinable() ? drain_mutex_ :
+                                          mutex);
+  if (!tag.empty())
     *os_ << name_ << ": " << tag << ": ";
-  }
   *os_ << msg << std::endl;
 }
 
-unsigned Logger::verbosity() const { return verbosity_; }
 int Logger::exit_status() const { return exit_status_; }
+
+// Returns the ring of the calling thread, adding one the first time.
+LogRing* Logger::ThreadRing() {
+  for (auto ring : tThreadRings.rings) {
+    if (ring->logger_id == id_)
+      return ring;
+  }
+
+  auto ring = new LogRing(id_);
+  tThreadRings.rings.push_back(ring);
+  ring->next = rings_.load();
+  while (!rings_.compare_exchange_weak(ring->next, ring))
+    ;
+  return ring;
+}
+
+// Copies the message into the ring of the thread, once there is room,
+// returning false if it cannot fit at all (once the ring is written out).
+bool Logger::Enqueue(const std::string& tag, const std::string& msg) {
+  const std::string& prefix = tag.empty() ? "" : name_ + ": " + tag + ": ";
+  uint32_t size = prefix.size() + msg.size() + 1;
+  auto ring = ThreadRing();
+  if (sizeof(size) + size > LogRing::kSize) {
+    Flush();
+    return false;
+  }
+  while (ring->free() < sizeof(size) + size) {
+    pending_ = true;
+    wake_.notify_one();
+    std::this_thread::yield();
+  }
+
+  size_t head = ring->head.load(std::memory_order_relaxed);
+  ring->CopyIn(head, &size, sizeof(size));
+  ring->CopyIn(head += sizeof(size), prefix.data(), prefix.size());
+  ring->CopyIn(head += prefix.size(), msg.data(), msg.size());
+  ring->CopyIn(head += msg.size(), "\n", 1);
+  ring->head.store(head + 1, std::memory_order_release);
+
+  // wake the writing thread for the first message since it last looked
+  if (!pending_.exchange(true))
+    wake_.notify_one();
+  return true;
+}
+
+// Writes out what is in the rings at once, and frees the rings of threads
+// that exited, once empty.
+void Logger::Drain() {
+  std::lock_guard<std::mutex> locker(drain_mutex_);
+  pending_ = false;
+  std::string batch;
+  LogRing* prev = NULL;
+  for (auto ring = rings_.load(); ring != NULL; ) {
+    bool exited = ring->refs.load() == 1; // (so done writing into it)
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t head = ring->head.load(std::memory_order_acquire);
+    while (tail != head) {
+      uint32_t size;
+      ring->CopyOut(tail, &size, sizeof(size));
+      size_t batch_size = batch.size();
+      batch.resize(batch_size + size);
+      ring->CopyOut(tail + sizeof(size), &batch[batch_size], size);
+      tail += sizeof(size) + size;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+
+    // (the first ring may be having another one added before it)
+    auto next = ring->next;
+    if (prev != NULL && exited) {
+      prev->next = next;
+      ring->Release();
+    } else {
+      prev = ring;
+    }
+    ring = next;
+  }
+
+  if (!batch.empty()) {
+    os_->write(batch.data(), batch.size());
+    os_->flush();
+  }
+}
@@ -1,29 +1,81 @@
 #ifndef UTIL_LOGGER_HPP_
 #define UTIL_LOGGER_HPP_
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
 
+// the highest verbosity logged at all, chosen when building, so that the
+// more verbose statements are compiled out
+#ifndef LOGGER_MAX_VERBOSITY
+#define LOGGER_MAX_VERBOSITY 3
+#endif
+
+// Whether a message of the verbosity is logged: a single branch, predicted
+// not to be taken.
+#define LOG_ENABLED(logger, min_verbosity)                              \
+  ((min_verbosity) <= LOGGER_MAX_VERBOSITY &&                           \
+   __builtin_expect((logger)->verbosity() >= (min_verbosity), 0))
+
+// Logs the message as Logger::Verbose, but only builds it (evaluates msg) if
+// it is logged.
+#define LOG_VERBOSE(logger, min_verbosity, msg)                         \
+  do {                                                                  \
+    if (LOG_ENABLED(logger, min_verbosity))                             \
+      (logger)->Verbose((msg), (min_verbosity));                        \
+  } while (0)
+
+struct LogRing;
+
+// Writes messages (tagged, and prefixed with the name, unless verbose) as
+// lines, on the logging thread, or else on a thread of its own.
 class Logger {
  public:
   Logger(const std::string& name, unsigned verbosity,
          std::ostream* os = &std::cerr);
+  ~Logger();
+
+  void WriteInBackground();
+  void Flush();
+
   void Verbose(const std::string& msg, unsigned min_verbosity = 1);
   void Warn(const std::string& msg);
   void Warn();
   void Error(const std::string& msg);
   void Fatal(const std::string& msg);
 
-  unsigned verbosity() const;
+  unsigned verbosity() const { return verbosity_; }
   int exit_status() const;
  protected:
   void Write(const std::string& tag, const std::string& msg);
  private:
+  Logger(const Logger&);
+  Logger& operator=(const Logger&);
+
+  LogRing* ThreadRing();
+  bool Enqueue(const std::string& tag, const std::string& msg);
+  void Drain();
+
   std::string name_;
   unsigned verbosity_;
   std::ostream* os_;
-  int exit_status_;
+  std::atomic<int> exit_status_;
+
+  // in the background, each logging thread copies its messages into a ring
+  // of its own, without locking, which the writing thread drains in turn
+  const uint64_t id_;
+  std::atomic<LogRing*> rings_;
+  std::mutex drain_mutex_; // of reading the rings and writing
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::atomic<bool> pending_;
+  bool stopping_;
+  std::thread writer_;
 };
 
 #endif  // UTIL_LOGGER_HPP_
@@ -0,0 +1,120 @@
+#include "watcher.hpp"
+
+#include "debug.hpp"
+#include "util/dir.hpp"
+#include "util/syscall.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+
+// how long a burst of files may pause (and last at most) before it is
+// reported, so that each file still shows up within a second
+const int kBurstPause = 100; // milliseconds
+const int kMaxBurst = 500; // milliseconds
+
+inline bool IsHidden(const char* name) {
+  return name[0] == '.'; // e.g. files being received by jpgsync itself
+}
+
+} // namespace
+
+// Starts watching right away, so that no file completed after construction
+// (e.g. during the initial scan of dir) is missed.
+Watcher::Watcher(const std::string& dir) : dir_(dir) {
+  int fd;
+  sys_call_rv(fd, inotify_init1, IN_CLOEXEC);
+  inotify_fd_ = fd;
+  sys_call(inotify_add_watch, inotify_fd_, dir.c_str(),
+           IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+  sys_call_rv(fd, eventfd, 0, EFD_CLOEXEC);
+  stop_fd_ = fd;
+}
+
+// Calls on_paths with the paths of the files completed in the last burst,
+// until stopped.
+void Watcher::Run(Callback on_paths) {
+  std::vector<std::string> paths;
+  struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  int timeout = -1;
+  auto burst_end = std::chrono::steady_clock::now();
+  while (true) {
+    int ready;
+    sys_call_rv(ready, poll, fds, 2, timeout);
+    if (fds[1].revents)
+      break;
+
+    if (ready) {
+      if (paths.empty()) {
+        burst_end = (std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(kMaxBurst));
+      }
+      if (!Read(&paths)) // events were lost, so report all files
+        List(&paths);
+    }
+
+    // wait for the burst to pause (or to last too long) before reporting it
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        burst_end - std::chrono::steady_clock::now()).count();
+    if (!paths.empty() && ready && left > 0) {
+      timeout = std::min<int>(kBurstPause, left);
+      continue;
+    }
+    if (!paths.empty()) {
+      std::sort(paths.begin(), paths.end());
+      paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+      DEBUG_OUT_LN(WATCH, "count=%lu | REPORTING", paths.size());
+      on_paths(paths);
+      paths.clear();
+    }
+    timeout = -1;
+  }
+}
+
+// Makes Run return (from any thread).
+void Watcher::Stop() {
+  uint64_t one = 1;
+  sys_call(write, stop_fd_, &one, sizeof(one));
+}
+
+// Reads the pending events, adding the paths of completed files, or returns
+// false if the kernel dropped events.
+bool Watcher::Read(std::vector<std::string>* paths) {
+  char buf[64 * (sizeof(inotify_event) + NAME_MAX + 1)]
+      __attribute__((aligned(__alignof__(inotify_event))));
+  ssize_t read_count;
+  sys_call_rv(read_count, read, inotify_fd_, buf, sizeof(buf));
+  bool complete = true;
+  for (auto bytes = buf; bytes < buf + read_count; ) {
+    auto event = reinterpret_cast<const inotify_event*>(bytes);
+    bytes += sizeof(inotify_event) + event->len;
+    if (event->mask & IN_Q_OVERFLOW)
+      complete = false;
+    if (!event->len || (event->mask & IN_ISDIR) || IsHidden(event->name))
+      continue;
+
+    // (images received by jpgsync are reported by the inode names of their
+    // anonymous files, which are gone once they are linked)
+    std::string path = dir_ + '/' + event->name;
+    if (access(path.c_str(), F_OK) == 0)
+      paths->push_back(path);
+  }
+  return complete;
+}
+
+void Watcher::List(std::vector<std::string>* paths) {
+  Dir dir(dir_);
+  for (const std::string* path; !(path = &dir.Next())->empty(); ) {
+    if (!IsHidden(path->c_str() + path->rfind('/') + 1))
+      paths->push_back(*path);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef WATCHER_HPP_
+#define WATCHER_HPP_
+
+#include "util/fd.hpp"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Reports the files completed in a directory (closed after writing or moved
+// in, but not while still being written), a burst of them at a time.
+class Watcher {
+ public:
+  typedef std::function<void(const std::vector<std::string>&)> Callback;
+
+  Watcher(const std::string& dir);
+
+  void Run(Callback on_paths);
+  void Stop();
+
+ private:
+  bool Read(std::vector<std::string>* paths);
+  void List(std::vector<std::string>* paths);
+
+  std::string dir_;
+  FD inotify_fd_;
+  FD stop_fd_;
+};
+
+#endif // WATCHER_HPP_
@@ -0,0 +1,213 @@
+#include "writer_pool.hpp"
+
+#include "debug.hpp"
+#include "util/logger.hpp"
+#include "util/string_utils.hpp"
+#include "util/syscall.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace {
+
+inline std::string ToProcPath(int fd) {
+  return "/proc/self/fd/" + ToString(fd);
+}
+
+} // namespace
+
+WriterPool::WriterPool(const std::string& dir, size_t thread_count,
+                       size_t batch_size, Logger* logger)
+    : dir_(dir),
+      batch_size_(batch_size),
+      max_queued_(2 * thread_count),
+      logger_(logger),
+      busy_count_(0),
+      tmp_count_(0),
+      done_(false) {
+  int fd;
+  sys_call_rv(fd, open, dir.c_str(), O_RDONLY | O_DIRECTORY);
+  dir_fd_ = fd;
+  for (size_t i = 0; i < thread_count; ++i)
+    threads_.push_back(std::thread([this] { Work(); }));
+}
+
+WriterPool::~WriterPool() {
+  Flush();
+  {
+    std::lock_guard<decltype(mutex_)> locker(mutex_);
+    done_ = true;
+    work_.notify_all();
+  }
+  for (auto& thr : threads_)
+    thr.join();
+}
+
+// Queues the job (taking over its data and name), blocking while the pool
+// is too far behind so that buffered images do not pile up in memory.
+void WriterPool::Submit(Job* job) {
+  std::unique_lock<decltype(mutex_)> locker(mutex_);
+  progress_.wait(locker, [this] { return jobs_.size() < max_queued_; });
+  jobs_.push_back(Job());
+  jobs_.back().data.swap(job->data);
+  jobs_.back().name.swap(job->name);
+  jobs_.back().tmp_name.swap(job->tmp_name);
+  jobs_.back().alt_name.swap(job->alt_name);
+  work_.notify_one();
+}
+
+// Waits for all submitted files to be written, then syncs and publishes them.
+// Reports the files not stored under their names since the last flush.
+void WriterPool::Flush(std::vector<Moved>* moved) {
+  std::vector<File> batch;
+  {
+    std::unique_lock<decltype(mutex_)> locker(mutex_);
+    progress_.wait(locker, [this] { return jobs_.empty() && !busy_count_; });
+    batch.swap(written_);
+  }
+  Commit(&batch);
+
+  // make the new directory entries durable as well
+  std::lock_guard<decltype(commit_mutex_)> locker(commit_mutex_);
+  sys_call(fsync, dir_fd_);
+  if (moved != nullptr)
+    moved->swap(moved_);
+  moved_.clear();
+}
+
+std::string WriterPool::ToPath(const std::string& name) const {
+  return dir_ + '/' + name;
+}
+
+void WriterPool::Work() {
+  std::vector<File> batch;
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<decltype(mutex_)> locker(mutex_);
+      work_.wait(locker, [this] { return !jobs_.empty() || done_; });
+      if (jobs_.empty())
+        break;
+      job.data.swap(jobs_.front().data);
+      job.name.swap(jobs_.front().name);
+      job.tmp_name.swap(jobs_.front().tmp_name);
+      job.alt_name.swap(jobs_.front().alt_name);
+      jobs_.pop_front();
+      ++busy_count_;
+      progress_.notify_all();
+    }
+
+    File file;
+    try {
+      Write(&job, &file);
+    } catch (const SysCallException& e) {
+      logger_->Verbose(e.what());
+      logger_->Error("failed to write " + ToPath(file.name));
+      file.fd = -1;
+    }
+
+    if (file.fd == -1) {
+      std::lock_guard<decltype(commit_mutex_)> locker(commit_mutex_);
+      moved_.push_back(Moved(file.name, std::string()));
+    }
+    {
+      std::lock_guard<decltype(mutex_)> locker(mutex_);
+      if (file.fd != -1)
+        written_.push_back(file);
+      if (written_.size() >= batch_size_)
+        batch.swap(written_);
+      --busy_count_;
+      progress_.notify_all();
+    }
+    Commit(&batch);
+  }
+}
+
+void WriterPool::Write(Job* job, File* file) {
+  file->name.swap(job->name);
+  file->tmp_name.swap(job->tmp_name);
+  file->alt_name.swap(job->alt_name);
+  bool created = file->tmp_name.empty();
+  if (!created) {
+    sys_call_rv(file->fd, openat, dir_fd_, file->tmp_name.c_str(),
+                O_WRONLY | O_APPEND);
+  } else if ((file->fd = openat(dir_fd_, ".", O_TMPFILE | O_WRONLY,
+                                0666)) == -1) {
+    // the filesystem cannot do anonymous files, so use a hidden named one
+    size_t pos = file->name.rfind('/') + 1; // next to the final name
+    {
+      std::lock_guard<decltype(mutex_)> locker(mutex_);
+      file->tmp_name = file->name.substr(0, pos) + "." +
+          file->name.substr(pos) + "." + ToString(++tmp_count_) + ".part";
+    }
+    sys_call_rv(file->fd, openat, dir_fd_, file->tmp_name.c_str(),
+                O_CREAT | O_EXCL | O_WRONLY, 0666);
+  }
+  DEBUG_OUT_LN(WRITE, "fd=%2d; size=%lu; name=%s | WRITING", file->fd,
+               job->data.size(), file->name.c_str());
+
+  try {
+    for (size_t offset = 0; offset < job->data.size(); ) {
+      ssize_t write_count;
+      sys_call_rv(write_count, write, file->fd, job->data.data() + offset,
+                  job->data.size() - offset);
+      offset += write_count;
+    }
+  } catch (...) {
+    close(file->fd);
+    if (created && !file->tmp_name.empty())
+      unlinkat(dir_fd_, file->tmp_name.c_str(), 0);
+    throw;
+  }
+}
+
+// Syncs the written files to disk and only then links them under their names.
+void WriterPool::Commit(std::vector<File>* batch) {
+  if (batch->empty())
+    return;
+
+  std::lock_guard<decltype(commit_mutex_)> locker(commit_mutex_);
+  DEBUG_OUT_LN(WRITE, "count=%lu | COMMITTING", batch->size());
+  sys_call(syncfs, dir_fd_);
+  for (const auto& file : *batch) {
+    Publish(file);
+    close(file.fd);
+  }
+  batch->clear();
+}
+
+// Links the file under its name, which must be free (resolved by the caller),
+// or else under its alternative name, if any.
+void WriterPool::Publish(const File& file) {
+  auto link = [&](const std::string& name) {
+    return (file.tmp_name.empty() ?
+            linkat(AT_FDCWD, ToProcPath(file.fd).c_str(), dir_fd_,
+                   name.c_str(), AT_SYMLINK_FOLLOW) :
+            linkat(dir_fd_, file.tmp_name.c_str(), dir_fd_, name.c_str(), 0));
+  };
+  int ret = link(file.name);
+  const std::string* name = &file.name;
+  if (ret == -1 && errno == EEXIST && !file.alt_name.empty()) {
+    logger_->Verbose("file created concurrently: " + ToPath(file.name));
+    ret = link(*(name = &file.alt_name));
+  }
+
+  if (ret == 0) {
+    LOG_VERBOSE(logger_, 2, "stored " + ToPath(*name));
+  } else if (errno == EEXIST) {
+    logger_->Error("file created concurrently, not replacing " +
+                   ToPath(*name));
+  } else {
+    logger_->Error(std::string("failed to link ") + ToPath(*name) + ": " +
+                   strerror(errno));
+  }
+  if (ret != 0 || name != &file.name)
+    moved_.push_back(Moved(file.name, ret == 0 ? *name : std::string()));
+
+  if (!file.tmp_name.empty())
+    unlinkat(dir_fd_, file.tmp_name.c_str(), 0);
+}
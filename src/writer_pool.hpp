@@ -0,0 +1,72 @@
+#ifndef WRITER_POOL_HPP_
+#define WRITER_POOL_HPP_
+
+#include "util/fd.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Logger;
+
+// Writes files into a directory on a pool of threads. Each file is written
+// to an anonymous temporary and linked under its name only after its whole
+// batch has been synced, so a crash never leaves a partial file behind.
+class WriterPool {
+ public:
+  struct Job {
+    std::vector<char> data;
+    std::string name;
+    std::string tmp_name; // if set, existing file with (the start of) data
+    std::string alt_name; // if set, used instead if name is taken by then
+  };
+
+  // a file stored under another name than asked for (empty if not stored)
+  typedef std::pair<std::string, std::string> Moved;
+
+  WriterPool(const std::string& dir, size_t thread_count, size_t batch_size,
+             Logger* logger);
+  ~WriterPool();
+
+  void Submit(Job* job);
+  void Flush(std::vector<Moved>* moved = nullptr);
+
+ private:
+  struct File {
+    int fd;
+    std::string tmp_name; // empty if anonymous (O_TMPFILE)
+    std::string name;
+    std::string alt_name;
+  };
+
+  std::string ToPath(const std::string& name) const;
+  void Work();
+  void Write(Job* job, File* file);
+  void Commit(std::vector<File>* batch);
+  void Publish(const File& file);
+
+  std::string dir_;
+  FD dir_fd_;
+  size_t batch_size_;
+  size_t max_queued_;
+  Logger* logger_;
+
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable progress_;
+  std::deque<Job> jobs_;
+  std::vector<File> written_;
+  size_t busy_count_;
+  size_t tmp_count_;
+  bool done_;
+
+  std::mutex commit_mutex_;
+  std::vector<Moved> moved_;
+  std::vector<std::thread> threads_;
+};
+
+#endif // WRITER_POOL_HPP_
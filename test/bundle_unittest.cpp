@@ -0,0 +1,100 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../src/bundle.hpp"
+#include "../src/manifest.hpp"
+#include "../src/util/logger.hpp"
+#include "../src/util/string_utils.hpp"
+
+#include "test.hpp"
+
+using namespace std;
+
+namespace {
+
+string ReadAll(const string& path) {
+  ifstream ifs(path);
+  ostringstream oss;
+  oss << ifs.rdbuf();
+  return oss.str();
+}
+
+vector<string> List(const string& dir) {
+  vector<string> names;
+  DIR* dirp = opendir(dir.c_str());
+  while (auto dirent = readdir(dirp))
+    names.push_back(dirent->d_name);
+  closedir(dirp);
+  sort(names.begin(), names.end());
+  return names;
+}
+
+} // namespace
+
+TEST(BundleTest, WriteAndApply) {
+  char src[] = "/tmp/bundle_unittest_src.XXXXXX";
+  char dst[] = "/tmp/bundle_unittest_dst.XXXXXX";
+  ASSERT_TRUE(mkdtemp(src) && mkdtemp(dst));
+  auto bundle_path = string(src) + "/.bundle";
+
+  vector<ManifestFile::Entry> entries;
+  for (int i = 0; i < 3; ++i) {
+    ManifestFile::Entry entry;
+    unsigned char digest[sizeof(ExifHash)] = { (unsigned char)i };
+    entry.hash = ExifHash(digest);
+    entry.path = "img" + to_string(i) + ".jpg";
+    entry.size = entry.mtime = 0;
+    entries.push_back(entry);
+    ofstream(string(src) + '/' + entry.path) << string(100000 * i, 'a' + i);
+  }
+  ofstream(string(dst) + "/img1.jpg") << "taken";
+  ManifestFile::Write(string(src) + "/.jm", &entries, false);
+  ManifestFile manifest(string(src) + "/.jm");
+
+  Logger logger("test", 0);
+  vector<size_t> inds = { 0, 1, 2 };
+  int fd = open(bundle_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  ASSERT_NE(-1, fd);
+  EXPECT_EQ(3, WriteBundle(fd, src, manifest, inds, &logger));
+  close(fd);
+
+  fd = open(bundle_path.c_str(), O_RDONLY);
+  ASSERT_NE(-1, fd);
+  EXPECT_EQ(3, ApplyBundle(fd, dst, &logger));
+  close(fd);
+  EXPECT_EQ("", ReadAll(string(dst) + "/img0.jpg"));
+  EXPECT_EQ("taken", ReadAll(string(dst) + "/img1.jpg"));
+  auto renamed = string(dst) + "/img1.jpg-" + ToString(manifest.hash(1));
+  EXPECT_EQ(string(100000, 'b'), ReadAll(renamed));
+  EXPECT_EQ(string(200000, 'c'), ReadAll(string(dst) + "/img2.jpg"));
+
+  // applying it again changes nothing
+  auto names = List(dst);
+  for (int i = 0; i < 2; ++i) {
+    fd = open(bundle_path.c_str(), O_RDONLY);
+    ASSERT_NE(-1, fd);
+    EXPECT_EQ(0, ApplyBundle(fd, dst, &logger));
+    close(fd);
+    EXPECT_EQ(names, List(dst));
+  }
+
+  // a truncated bundle is refused
+  truncate(bundle_path.c_str(), 1000);
+  fd = open(bundle_path.c_str(), O_RDONLY);
+  EXPECT_THROW(ApplyBundle(fd, dst, &logger), runtime_error);
+  close(fd);
+
+  system(("rm -rf " + string(src) + ' ' + string(dst)).c_str());
+}
@@ -1,4 +1,7 @@
+#include <cstring>
+#include <string>
 #include <unordered_set>
+#include <vector>
 
 #include "../src/exif_hash.hpp"
 
@@ -34,3 +37,56 @@ TEST(ExifHashCollisionTest, SameHash) {
   EXPECT_NE(ef1, ef3);
   EXPECT_NE(std::hash<ExifHash>()(ef2), std::hash<ExifHash>()(ef3));
 }
+
+TEST(ExifHashDigestTest, Sha1) {
+  unsigned char digest[Sha1::kSize];
+  Sha1::Context ctx;
+  ctx.Update("abc", 3);
+  ctx.Final(digest);
+  BasicExifHash<Sha1> eh(digest);
+  std::ostringstream oss; oss << eh;
+  ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", oss.str());
+}
+
+TEST(ExifHashDigestTest, Blake2s) {
+  unsigned char digest[Blake2s::kSize];
+  Blake2s::Context ctx;
+  ctx.Update("a", 1);
+  ctx.Update("bc", 2);
+  ctx.Final(digest);
+  BasicExifHash<Blake2s> eh(digest);
+  ASSERT_EQ(16, sizeof(eh));
+  std::ostringstream oss; oss << eh;
+  // the first half of the BLAKE2s-256 digest
+  ASSERT_EQ("508c5e8c327c14e2e1a72ba34eeb452f", oss.str());
+
+  unsigned char round_trip[Blake2s::kSize];
+  eh.ToDigest(round_trip);
+  EXPECT_EQ(0, memcmp(digest, round_trip, sizeof(digest)));
+}
+
+TEST(ExifHashDigestTest, Sha1Many) {
+  // lengths straddling the block and padding boundaries, in uneven batches
+  std::vector<std::string> inputs;
+  for (size_t i = 0; i < 21; ++i)
+    inputs.push_back(std::string(i * 29 % 200, static_cast<char>('a' + i)));
+  for (size_t count = 1; count <= inputs.size(); count += 5) {
+    std::vector<const unsigned char*> data;
+    std::vector<size_t> sizes;
+    std::vector<unsigned char> many(count * Sha1::kSize);
+    std::vector<unsigned char*> digests;
+    for (size_t i = 0; i < count; ++i) {
+      data.push_back(reinterpret_cast<const unsigned char*>(inputs[i].data()));
+      sizes.push_back(inputs[i].size());
+      digests.push_back(&many[i * Sha1::kSize]);
+    }
+    DigestMany<Sha1>(&data[0], &sizes[0], count, &digests[0]);
+    for (size_t i = 0; i < count; ++i) {
+      unsigned char digest[Sha1::kSize];
+      Sha1::Context ctx;
+      ctx.Update(inputs[i].data(), inputs[i].size());
+      ctx.Final(digest);
+      EXPECT_EQ(0, memcmp(digest, digests[i], sizeof(digest)));
+    }
+  }
+}
@@ -26,7 +26,7 @@ int main(int argc, char* argv[]) {
     auto e = exif_hasher.Get(&count);
     cerr << "main: got " << count << endl;
     for (auto i = count; i--; e = e->next)
-      cerr << "main: " << *e->hash << endl;
+      cerr << "main: " << e->hash << endl;
   } while (count);
 
   if (is != &cin)
@@ -0,0 +1,53 @@
+#include <cstring>
+#include <vector>
+
+#include "../src/frozen_hash_set.hpp"
+
+#include "test.hpp"
+
+using namespace std;
+
+TEST(FrozenHashSetTest, Empty) {
+  FrozenHashSet s;
+  EXPECT_EQ(0, s.size());
+  EXPECT_FALSE(s.Contains(MakeHash(0, 0)));
+
+  vector<ExifHash> none;
+  FrozenHashSet t(&none);
+  EXPECT_EQ(0, t.size());
+  EXPECT_FALSE(t.Contains(MakeHash(0, 0)));
+}
+
+TEST(FrozenHashSetTest, ContainsAllSizes) {
+  // every tree shape up to a few levels, with the odd hashes left out
+  for (uint32_t count = 1; count < 70; ++count) {
+    vector<ExifHash> hashes;
+    for (uint32_t i = count; i--; )
+      hashes.push_back(MakeHash(2 * i * 0x01010101, i));
+    hashes.push_back(hashes.front()); // repeated
+    FrozenHashSet s(&hashes);
+    ASSERT_EQ(count, s.size());
+    for (uint32_t i = 0; i < 2 * count + 1; ++i)
+      EXPECT_EQ(i % 2 == 0 && i < 2 * count,
+                s.Contains(MakeHash(i * 0x01010101, i / 2)));
+  }
+}
+
+TEST(FrozenHashSetTest, SharedPrefixes) {
+  // hashes differing only past the prefix searched first
+  vector<ExifHash> hashes;
+  for (uint32_t i = 0; i < 10; ++i) {
+    hashes.push_back(MakeHash(7, 3 * i));
+    hashes.push_back(MakeHash(i, 0));
+  }
+  FrozenHashSet s(&hashes);
+  ASSERT_EQ(19, s.size());
+  for (uint32_t i = 0; i < 30; ++i)
+    EXPECT_EQ(i % 3 == 0, s.Contains(MakeHash(7, i)));
+  EXPECT_FALSE(s.Contains(MakeHash(11, 0)));
+
+  FrozenHashSet t;
+  t.swap(s);
+  EXPECT_EQ(0, s.size());
+  EXPECT_TRUE(t.Contains(MakeHash(7, 27)));
+}
@@ -0,0 +1,84 @@
+#include <climits>
+#include <cstring>
+#include <vector>
+
+#include "../src/hash_index.hpp"
+
+#include "test.hpp"
+
+using namespace std;
+
+TEST(HashIndexTest, InsertAndGrow) {
+  HashIndex index;
+  // spread hashes and ones colliding on their home slot, through growing
+  for (uint32_t i = 0; i < 5000; ++i) {
+    ASSERT_TRUE(index.Insert(MakeHash(i * 0x9E3779B9, i)));
+    ASSERT_TRUE(index.Insert(MakeHash(42, i + 1)));
+  }
+  EXPECT_EQ(10000, index.size());
+  EXPECT_FALSE(index.Insert(MakeHash(42, 1)));
+  for (uint32_t i = 0; i < 5000; ++i) {
+    EXPECT_TRUE(index.Contains(MakeHash(i * 0x9E3779B9, i)));
+    EXPECT_TRUE(index.Contains(MakeHash(42, i + 1)));
+    EXPECT_FALSE(index.Contains(MakeHash(i * 0x9E3779B9, i + 1)));
+  }
+  EXPECT_EQ(10000, index.size());
+}
+
+TEST(HashIndexTest, ZeroHash) {
+  HashIndex index;
+  EXPECT_FALSE(index.Contains(MakeHash(0, 0)));
+  EXPECT_TRUE(index.Insert(MakeHash(0, 0)));
+  EXPECT_FALSE(index.Insert(MakeHash(0, 0)));
+  EXPECT_TRUE(index.Contains(MakeHash(0, 0)));
+  EXPECT_FALSE(index.Contains(MakeHash(0, 1)));
+  EXPECT_EQ(1, index.size());
+}
+
+TEST(HashIndexTest, Erase) {
+  HashIndex index;
+  // runs of colliding hashes, one of them wrapping around the end
+  for (uint32_t i = 0; i < 300; ++i) {
+    index.Insert(MakeHash(42, i + 1));
+    index.Insert(MakeHash(0xFFFFFFFF, i));
+    index.Insert(MakeHash((i + 1) * 0x9E3779B9, i));
+  }
+  index.Insert(MakeHash(0, 0));
+  for (uint32_t i = 0; i < 300; i += 2) {
+    ASSERT_TRUE(index.Erase(MakeHash(42, i + 1)));
+    ASSERT_TRUE(index.Erase(MakeHash(0xFFFFFFFF, i)));
+    ASSERT_TRUE(index.Erase(MakeHash((i + 1) * 0x9E3779B9, i)));
+  }
+  EXPECT_FALSE(index.Erase(MakeHash(42, 1)));
+  EXPECT_TRUE(index.Erase(MakeHash(0, 0)));
+  EXPECT_FALSE(index.Erase(MakeHash(0, 0)));
+  EXPECT_EQ(450, index.size());
+  for (uint32_t i = 0; i < 300; ++i) {
+    EXPECT_EQ(i % 2 == 1, index.Contains(MakeHash(42, i + 1)));
+    EXPECT_EQ(i % 2 == 1, index.Contains(MakeHash(0xFFFFFFFF, i)));
+    EXPECT_EQ(i % 2 == 1, index.Contains(MakeHash((i + 1) * 0x9E3779B9, i)));
+  }
+  EXPECT_FALSE(index.Contains(MakeHash(0, 0)));
+
+  // erased hashes can be added again
+  EXPECT_TRUE(index.Insert(MakeHash(42, 1)));
+  EXPECT_TRUE(index.Contains(MakeHash(42, 1)));
+}
+
+TEST(HashIndexTest, ContainsBatch) {
+  HashIndex index;
+  vector<ExifHash> hashes;
+  for (uint32_t i = 0; i < 20; ++i) {
+    hashes.push_back(MakeHash(i * 0x9E3779B9, i));
+    if (i % 3 == 0)
+      index.Insert(hashes.back());
+  }
+
+  unsigned char bitmask[(20 + CHAR_BIT - 1) / CHAR_BIT];
+  memset(bitmask, 0, sizeof(bitmask));
+  bitmask[2] = 0x80; // left alone
+  index.ContainsBatch(hashes.data(), hashes.size(), bitmask);
+  EXPECT_EQ(0x49, bitmask[0]); // 0, 3, 6
+  EXPECT_EQ(0x92, bitmask[1]); // 9, 12, 15
+  EXPECT_EQ(0x84, bitmask[2]); // 18
+}
@@ -0,0 +1,87 @@
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/util/logger.hpp"
+
+#include "test.hpp"
+
+using namespace std;
+
+namespace {
+
+string Build(int* count, const string& msg) {
+  ++*count;
+  return msg;
+}
+
+} // namespace
+
+TEST(LoggerTest, LogVerboseIsLazy) {
+  ostringstream oss;
+  Logger logger("test", 1, &oss);
+  int count = 0;
+  LOG_VERBOSE(&logger, 2, Build(&count, "hidden"));
+  EXPECT_EQ(0, count);
+  LOG_VERBOSE(&logger, 1, Build(&count, "shown"));
+  EXPECT_EQ(1, count);
+  EXPECT_EQ("shown\n", oss.str());
+
+  EXPECT_TRUE(LOG_ENABLED(&logger, 1));
+  EXPECT_FALSE(LOG_ENABLED(&logger, 2));
+  EXPECT_FALSE(LOG_ENABLED(&logger, LOGGER_MAX_VERBOSITY + 1));
+}
+
+TEST(LoggerTest, WriteInBackground) {
+  ostringstream oss;
+  {
+    Logger logger("test", 1, &oss);
+    logger.WriteInBackground();
+    // more than fits into the ring of each thread
+    const int kThreadCount = 4, kLineCount = 5000;
+    vector<thread> threads;
+    for (int t = 0; t < kThreadCount; ++t) {
+      threads.push_back(thread([&logger, t] {
+            for (int i = 0; i < kLineCount; ++i) {
+              logger.Verbose(to_string(t) + ' ' + to_string(i));
+              if (t == 0 && i % 1000 == 0) // more than a ring holds
+                logger.Verbose(string(1 << 17, 'x'));
+            }
+          }));
+    }
+    for (auto& thr : threads)
+      thr.join();
+    logger.Error("failed");
+    logger.Flush();
+    EXPECT_EQ(2, logger.exit_status());
+
+    // all lines are there, in order for each thread (only)
+    istringstream iss(oss.str());
+    vector<int> next(kThreadCount);
+    int count = 0;
+    int long_count = 0;
+    bool error_seen = false;
+    string line;
+    while (getline(iss, line)) {
+      istringstream line_iss(line);
+      int t, i;
+      if (line_iss >> t >> i) {
+        ASSERT_TRUE(t >= 0 && t < kThreadCount);
+        EXPECT_EQ(next[t]++, i);
+        ++count;
+      } else if (line == "test: error: failed") {
+        error_seen = true;
+      } else {
+        EXPECT_EQ(size_t(1) << 17, line.size());
+        ++long_count;
+      }
+    }
+    EXPECT_EQ(kThreadCount * kLineCount, count);
+    EXPECT_TRUE(error_seen);
+    EXPECT_EQ(kLineCount / 1000, long_count);
+    logger.Verbose("last");
+  }
+  // written out when the logger goes
+  EXPECT_EQ("last\n", oss.str().substr(oss.str().size() - 5));
+}
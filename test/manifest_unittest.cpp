@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../src/manifest.hpp"
+
+#include "test.hpp"
+
+using namespace std;
+
+TEST(ManifestTest, Sort) {
+  vector<ExifHash> hashes;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    hashes.push_back(MakeHash(i * 0x9E3779B9, i));
+    hashes.push_back(MakeHash(42, i % 10)); // sharing their leading bits
+  }
+  EXPECT_FALSE(IsManifest(hashes.data(), hashes.size()));
+  SortManifest(&hashes);
+  EXPECT_EQ(1010, hashes.size());
+  EXPECT_TRUE(IsManifest(hashes.data(), hashes.size()));
+  for (size_t i = 1; i < hashes.size(); ++i)
+    EXPECT_TRUE(hashes[i - 1] < hashes[i]);
+}
+
+TEST(ManifestTest, Diff) {
+  vector<ExifHash> a, b;
+  for (uint32_t i = 0; i < 300; ++i) {
+    if (i % 2 == 0)
+      a.push_back(MakeHash(i / 3, i));
+    if (i % 3 == 0)
+      b.push_back(MakeHash(i / 3, i));
+  }
+  vector<size_t> a_only, b_only;
+  DiffManifests(a.data(), a.size(), b.data(), b.size(), &a_only, &b_only);
+  ASSERT_EQ(100, a_only.size()); // even, but no multiple of 3
+  ASSERT_EQ(50, b_only.size()); // odd multiples of 3
+  for (auto i : a_only)
+    EXPECT_FALSE(binary_search(b.begin(), b.end(), a[i]));
+  for (auto j : b_only)
+    EXPECT_FALSE(binary_search(a.begin(), a.end(), b[j]));
+
+  a_only.clear();
+  b_only.clear();
+  DiffManifests(a.data(), a.size(), NULL, 0, &a_only, &b_only);
+  EXPECT_EQ(a.size(), a_only.size());
+  EXPECT_TRUE(b_only.empty());
+}
+
+TEST(ManifestFileTest, WriteAndFind) {
+  auto path = "/tmp/manifest_unittest.jm";
+  vector<ManifestFile::Entry> entries;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    ManifestFile::Entry entry;
+    entry.hash = MakeHash(i % 500 * 0x9E3779B9, i % 500); // each twice
+    entry.path = "dir/" + to_string(i) + ".jpg";
+    entry.size = i;
+    entry.mtime = -int64_t(i);
+    entries.push_back(entry);
+  }
+  auto written = entries;
+  ManifestFile::Write(path, &written, true);
+
+  ManifestFile manifest(path);
+  ASSERT_EQ(1000, manifest.size());
+  EXPECT_TRUE(manifest.has_stat());
+  for (const auto& entry : entries) {
+    size_t ind = manifest.FindPath(entry.path.c_str());
+    ASSERT_NE(ManifestFile::npos, ind);
+    EXPECT_EQ(entry.hash, manifest.hash(ind));
+    EXPECT_EQ(entry.size, manifest.file_size(ind));
+    EXPECT_EQ(entry.mtime, manifest.mtime(ind));
+    ind = manifest.Find(entry.hash);
+    ASSERT_NE(ManifestFile::npos, ind);
+    EXPECT_EQ(entry.hash, manifest.hash(ind));
+    ASSERT_EQ(entry.hash, manifest.hash(ind + 1)); // the first of both
+  }
+  EXPECT_EQ(ManifestFile::npos, manifest.Find(MakeHash(0, 1)));
+  EXPECT_EQ(ManifestFile::npos, manifest.FindPath("dir/1000.jpg"));
+  EXPECT_EQ(ManifestFile::npos, manifest.FindPath(""));
+  remove(path);
+}
+
+TEST(ManifestFileTest, EmptyAndInvalid) {
+  auto path = "/tmp/manifest_unittest.jm";
+  vector<ManifestFile::Entry> entries;
+  ManifestFile::Write(path, &entries, false);
+  {
+    ManifestFile manifest(path);
+    EXPECT_EQ(0, manifest.size());
+    EXPECT_FALSE(manifest.has_stat());
+    EXPECT_EQ(ManifestFile::npos, manifest.Find(MakeHash(0, 0)));
+    EXPECT_EQ(ManifestFile::npos, manifest.FindPath("a.jpg"));
+  }
+
+  // truncated
+  ofstream(path, ios::app) << "x";
+  EXPECT_THROW(ManifestFile manifest(path), runtime_error);
+  ofstream(path) << "0123456789abcdef0123456789abcdef0123456789abcdef";
+  EXPECT_THROW(ManifestFile manifest(path), runtime_error);
+  remove(path);
+}
+
+TEST(ManifestFileTest, InvalidPathOffset) {
+  auto path = "/tmp/manifest_unittest.jm";
+  vector<ManifestFile::Entry> entries(2);
+  entries[0].hash = MakeHash(1, 1);
+  entries[0].path = "a.jpg";
+  entries[1].hash = MakeHash(2, 2);
+  entries[1].path = "b.jpg";
+  // the offsets of the paths follow the 32-byte header and the digests
+  size_t offsets_pos = 32 + (2 * sizeof(ExifHash) + 7) / 8 * 8;
+  for (size_t column = 0; column < 2; ++column) {
+    auto written = entries;
+    ManifestFile::Write(path, &written, false);
+    {
+      fstream fs(path, ios::in | ios::out | ios::binary);
+      fs.seekp(offsets_pos + (column * 2 + 1) * sizeof(uint64_t));
+      fs.write("\xff\xff", 2);
+    }
+    EXPECT_THROW(ManifestFile manifest(path), runtime_error);
+  }
+  remove(path);
+}
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Syncs a slave with a serving master (jpgsync --serve) on this host, with the
+# options given (e.g. -c), and checks that both ends then have all images.
+# Usage: serve_test.sh [JPGSYNC] [OPTION]...
+jpgsync=${1:-$(dirname "$0")/../src/jpgsync}
+shift
+port=${PORT:-40123}
+
+dir=$(mktemp -d)
+trap 'kill $master_pid 2>/dev/null; rm -rf "$dir"' EXIT
+mkdir "$dir/m" "$dir/s"
+# images without EXIF, which -c identifies by their content
+for i in 1 2 3; do
+  head -c $((20000 * i)) /dev/urandom > "$dir/m/m$i.jpg"
+  head -c $((30000 * i)) /dev/urandom > "$dir/s/s$i.jpg"
+done
+
+cd "$dir"
+"$jpgsync" m -m -l --serve -p $port "$@" > master.out 2> master.err &
+master_pid=$!
+sleep 0.5
+timeout 20 "$jpgsync" s -s localhost:$port -l "$@" 2> slave.err
+status=$?
+if [ $status != 0 ]; then
+  echo "FAIL: slave exited with $status"
+  cat master.err slave.err
+  exit 1
+fi
+sleep 0.5 # the master publishes its downloads after the slave is done
+
+for d in m s; do
+  if [ $(ls $d | wc -l) != 6 ]; then
+    echo "FAIL: $d has $(ls $d | wc -l) images instead of 6"
+    cat master.err slave.err
+    exit 1
+  fi
+done
+echo PASS
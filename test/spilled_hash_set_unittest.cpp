@@ -0,0 +1,73 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "../src/spilled_hash_set.hpp"
+
+#include "test.hpp"
+
+using namespace std;
+
+TEST(SpilledHashSetTest, InMemory) {
+  SpilledHashSet s("/tmp", 1 << 20);
+  for (uint32_t i = 100; i--; )
+    s.Insert(MakeHash(2 * i * 0x9E3779B9, i));
+  s.Insert(MakeHash(0, 0)); // repeated
+  s.Freeze();
+  EXPECT_EQ(0, s.spill_count());
+  ASSERT_EQ(100, s.size());
+  EXPECT_TRUE(is_sorted(s.data(), s.data() + s.size()));
+  for (uint32_t i = 0; i < 100; ++i) {
+    EXPECT_TRUE(s.Contains(MakeHash(2 * i * 0x9E3779B9, i)));
+    EXPECT_FALSE(s.Contains(MakeHash(2 * i * 0x9E3779B9, i + 1)));
+  }
+}
+
+TEST(SpilledHashSetTest, Spilled) {
+  char dir[] = "/tmp/spilled_hash_set_unittest.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir));
+  {
+    // a budget of 100 hashes, with runs overlapping and hashes repeated
+    // across them, and many sharing their leading bits
+    SpilledHashSet s(dir, 100 * sizeof(ExifHash));
+    for (uint32_t i = 0; i < 3000; ++i) {
+      s.Insert(MakeHash(i % 1000 * 0x9E3779B9, i % 1000));
+      s.Insert(MakeHash(7, 2 * i));
+    }
+    s.Freeze();
+    EXPECT_EQ(60, s.spill_count());
+    ASSERT_EQ(4000, s.size());
+    EXPECT_TRUE(adjacent_find(s.data(), s.data() + s.size(),
+                              [](const ExifHash& lhs, const ExifHash& rhs) {
+                                return !(lhs < rhs);
+                              }) == s.data() + s.size());
+    for (uint32_t i = 0; i < 1000; ++i) {
+      EXPECT_TRUE(s.Contains(MakeHash(i * 0x9E3779B9, i)));
+      EXPECT_FALSE(s.Contains(MakeHash(i * 0x9E3779B9, i + 1)));
+    }
+    for (uint32_t i = 0; i < 6000; ++i)
+      EXPECT_EQ(i % 2 == 0, s.Contains(MakeHash(7, i)));
+
+    const ExifHash* hashes[3];
+    ExifHash found_hash = MakeHash(7, 10), missing_hash = MakeHash(8, 0);
+    hashes[0] = &found_hash;
+    hashes[1] = &missing_hash;
+    hashes[2] = s.data();
+    bool found[3];
+    s.ContainsBatch(hashes, 3, found);
+    EXPECT_TRUE(found[0]);
+    EXPECT_FALSE(found[1]);
+    EXPECT_TRUE(found[2]);
+  }
+  // the spilled files are anonymous
+  EXPECT_EQ(0, rmdir(dir));
+}
+
+TEST(SpilledHashSetTest, Empty) {
+  SpilledHashSet s("/tmp", 1);
+  s.Freeze();
+  EXPECT_EQ(0, s.size());
+  EXPECT_FALSE(s.Contains(MakeHash(0, 0)));
+}
@@ -1,6 +1,7 @@
 #ifndef TEST_HPP_
 #define TEST_HPP_
 
+#include <cstdint>
 #include <cstdlib>
 
 #include <algorithm>
@@ -14,6 +15,17 @@
 #include <gtest/gtest.h>
 
 #include "../src/debug.hpp"
+#include "../src/exif_hash.hpp"
+
+// Returns a hash starting and ending with the given bits (zero in between).
+inline ExifHash MakeHash(uint32_t high, uint32_t low) {
+  unsigned char digest[sizeof(ExifHash)] = {};
+  for (int i = 0; i < 4; ++i) {
+    digest[i] = high >> (24 - 8 * i);
+    digest[sizeof(ExifHash) - 4 + i] = low >> (24 - 8 * i);
+  }
+  return ExifHash(digest);
+}
 
 template<class InputIterator1, class InputIterator2, class Equals>
 bool CheckEq(InputIterator1 exp_begin, InputIterator1 exp_end,